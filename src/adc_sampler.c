@@ -0,0 +1,409 @@
+#include "adc_sampler.h"
+#include "time_utils.h"
+
+#include <libubox/uloop.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct adc_sample_st
+{
+    uint64_t msecs;
+    unsigned int value;
+} adc_sample_st;
+
+typedef struct adc_channel_st
+{
+    adc_sampler_st * adc_sampler;
+    unsigned int channel;
+    unsigned int sample_interval_millisecs; /* 0 if the channel isn't sampled. */
+    uint64_t next_sample_msecs;
+    bool read_in_progress;
+
+    unsigned int threshold; /* 0 if the channel has no threshold. */
+    unsigned int hysteresis;
+    bool above_threshold;
+    bool threshold_known; /* True once the channel has been sampled. */
+
+    /* A ring of the most recent samples. */
+    adc_sample_st * samples;
+    size_t next_sample;
+    size_t num_samples;
+} adc_channel_st;
+
+struct adc_sampler_st
+{
+    relay_module_st * relay_module;
+    struct uloop_timeout sample_timer;
+    adc_channel_st channels[ADC_MAX_CHANNELS];
+    state_changed_fn changed_cb;
+    void * changed_context;
+};
+
+static void adc_schedule_samples(adc_sampler_st * const adc_sampler)
+{
+    uint64_t next_sample_msecs = UINT64_MAX;
+    uint64_t const now_msecs = monotonic_time_msecs();
+    size_t index;
+
+    /* Channels with a read in progress are scheduled again once it
+     * has completed.
+     */
+    for (index = 0; index < ADC_MAX_CHANNELS; index++)
+    {
+        adc_channel_st const * const channel = &adc_sampler->channels[index];
+
+        if (channel->sample_interval_millisecs > 0
+            && !channel->read_in_progress
+            && channel->next_sample_msecs < next_sample_msecs)
+        {
+            next_sample_msecs = channel->next_sample_msecs;
+        }
+    }
+
+    if (next_sample_msecs == UINT64_MAX)
+    {
+        uloop_timeout_cancel(&adc_sampler->sample_timer);
+    }
+    else
+    {
+        uloop_timeout_set(&adc_sampler->sample_timer,
+                          (next_sample_msecs > now_msecs) ? next_sample_msecs - now_msecs : 0);
+    }
+}
+
+static void adc_check_threshold(adc_channel_st * const channel, unsigned int const value)
+{
+    adc_sampler_st * const adc_sampler = channel->adc_sampler;
+    bool above_threshold;
+
+    if (channel->threshold == 0)
+    {
+        goto done;
+    }
+
+    if (!channel->threshold_known || !channel->above_threshold)
+    {
+        above_threshold = value >= channel->threshold;
+    }
+    else
+    {
+        /* Stay above until the value has clearly dropped, so that 
+         * noise around the threshold doesn't cause a flood of 
+         * changes. 
+         */
+        above_threshold = value + channel->hysteresis >= channel->threshold;
+    }
+
+    if (channel->threshold_known && above_threshold == channel->above_threshold)
+    {
+        goto done;
+    }
+    channel->above_threshold = above_threshold;
+    channel->threshold_known = true;
+
+    if (adc_sampler->changed_cb != NULL)
+    {
+        state_change_st const change =
+        {
+            .type = STATE_CHANGE_ADC_THRESHOLD,
+            .channel = channel->channel,
+            .value = value,
+            .threshold = channel->threshold,
+            .above_threshold = above_threshold
+        };
+
+        adc_sampler->changed_cb(adc_sampler->changed_context, &change);
+    }
+
+done:
+    return;
+}
+
+static void adc_read_done(void * const user_context,
+                          bool const success,
+                          unsigned int const value)
+{
+    adc_channel_st * const channel = user_context;
+
+    channel->read_in_progress = false;
+
+    if (success)
+    {
+        adc_sample_st * const sample = &channel->samples[channel->next_sample];
+
+        sample->msecs = monotonic_time_msecs();
+        sample->value = value;
+        channel->next_sample = (channel->next_sample + 1) % ADC_HISTORY_LENGTH;
+        if (channel->num_samples < ADC_HISTORY_LENGTH)
+        {
+            channel->num_samples++;
+        }
+
+        adc_check_threshold(channel, value);
+    }
+
+    adc_schedule_samples(channel->adc_sampler);
+}
+
+static void adc_sample_timer_handler(struct uloop_timeout * const timeout)
+{
+    adc_sampler_st * const adc_sampler = container_of(timeout, adc_sampler_st, sample_timer);
+    uint64_t const now_msecs = monotonic_time_msecs();
+    size_t index;
+
+    for (index = 0; index < ADC_MAX_CHANNELS; index++)
+    {
+        adc_channel_st * const channel = &adc_sampler->channels[index];
+
+        if (channel->sample_interval_millisecs == 0
+            || channel->read_in_progress
+            || channel->next_sample_msecs > now_msecs)
+        {
+            continue;
+        }
+
+        /* Samples that were missed, because the module was slow or
+         * unreachable, are skipped rather than caught up on.
+         */
+        channel->next_sample_msecs += channel->sample_interval_millisecs;
+        if (channel->next_sample_msecs <= now_msecs)
+        {
+            channel->next_sample_msecs = now_msecs + channel->sample_interval_millisecs;
+        }
+
+        /* The read may complete before relay_module_read_adc() 
+         * returns, so the flag must already be set by then. 
+         */
+        channel->read_in_progress = true;
+        if (!relay_module_read_adc(adc_sampler->relay_module,
+                                   RELAY_MODULE_PRIORITY_TELEMETRY,
+                                   channel->channel,
+                                   adc_read_done,
+                                   channel))
+        {
+            channel->read_in_progress = false;
+        }
+    }
+
+    adc_schedule_samples(adc_sampler);
+}
+
+bool adc_sampler_get_stats(adc_sampler_st const * const adc_sampler,
+                           unsigned int const channel_index,
+                           unsigned int const window_millisecs,
+                           adc_stats_st * const stats)
+{
+    bool got_stats;
+    uint64_t const now_msecs = monotonic_time_msecs();
+    uint64_t total = 0;
+    size_t age;
+
+    if (channel_index >= ADC_MAX_CHANNELS
+        || adc_sampler->channels[channel_index].sample_interval_millisecs == 0)
+    {
+        got_stats = false;
+        goto done;
+    }
+
+    adc_channel_st const * const channel = &adc_sampler->channels[channel_index];
+
+    memset(stats, 0, sizeof *stats);
+
+    /* Work back from the newest sample until the start of the
+     * window.
+     */
+    for (age = 0; age < channel->num_samples; age++)
+    {
+        size_t const position =
+            (channel->next_sample + ADC_HISTORY_LENGTH - 1 - age) % ADC_HISTORY_LENGTH;
+        adc_sample_st const * const sample = &channel->samples[position];
+
+        if (window_millisecs > 0 && now_msecs - sample->msecs > window_millisecs)
+        {
+            break;
+        }
+
+        if (age == 0)
+        {
+            stats->last = sample->value;
+            stats->last_age_millisecs = now_msecs - sample->msecs;
+            stats->minimum = sample->value;
+            stats->maximum = sample->value;
+        }
+        else if (sample->value < stats->minimum)
+        {
+            stats->minimum = sample->value;
+        }
+        else if (sample->value > stats->maximum)
+        {
+            stats->maximum = sample->value;
+        }
+        total += sample->value;
+        stats->samples++;
+    }
+
+    if (stats->samples > 0)
+    {
+        stats->mean = (double)total / stats->samples;
+    }
+
+    got_stats = true;
+
+done:
+    return got_stats;
+}
+
+bool adc_sampler_channels_from_string(char const * const string,
+                                      adc_sampler_settings_st * const settings)
+{
+    bool parsed_channels;
+    char const * next = string;
+    adc_sampler_settings_st channels;
+
+    memset(&channels, 0, sizeof channels);
+
+    while (*next != '\0')
+    {
+        char * end;
+        unsigned long const channel = strtoul(next, &end, 10);
+        unsigned long interval = ADC_DEFAULT_SAMPLE_INTERVAL_MILLISECS;
+        unsigned long threshold = 0;
+
+        if (end == next || channel >= ADC_MAX_CHANNELS)
+        {
+            parsed_channels = false;
+            goto done;
+        }
+        next = end;
+
+        if (*next == ':')
+        {
+            next++;
+            interval = strtoul(next, &end, 10);
+            if (end == next || interval == 0)
+            {
+                parsed_channels = false;
+                goto done;
+            }
+            next = end;
+        }
+
+        if (*next == ':')
+        {
+            next++;
+            threshold = strtoul(next, &end, 10);
+            if (end == next)
+            {
+                parsed_channels = false;
+                goto done;
+            }
+            next = end;
+        }
+
+        if (*next != ',' && *next != '\0')
+        {
+            parsed_channels = false;
+            goto done;
+        }
+        if (*next == ',')
+        {
+            next++;
+        }
+
+        channels.sample_interval_millisecs[channel] = interval;
+        channels.threshold[channel] = threshold;
+        channels.hysteresis[channel] = ADC_DEFAULT_THRESHOLD_HYSTERESIS;
+    }
+
+    *settings = channels;
+    parsed_channels = true;
+
+done:
+    return parsed_channels;
+}
+
+adc_sampler_st * adc_sampler_create(relay_module_st * const relay_module,
+                                    adc_sampler_settings_st const * const settings,
+                                    state_changed_fn const changed_cb,
+                                    void * const changed_context)
+{
+    bool created_sampler;
+    adc_sampler_st * const adc_sampler = calloc(1, sizeof *adc_sampler);
+    uint64_t const now_msecs = monotonic_time_msecs();
+    size_t index;
+
+    if (adc_sampler == NULL)
+    {
+        created_sampler = false;
+        goto done;
+    }
+
+    adc_sampler->relay_module = relay_module;
+    adc_sampler->sample_timer.cb = adc_sample_timer_handler;
+    adc_sampler->changed_cb = changed_cb;
+    adc_sampler->changed_context = changed_context;
+
+    for (index = 0; index < ADC_MAX_CHANNELS; index++)
+    {
+        adc_channel_st * const channel = &adc_sampler->channels[index];
+
+        channel->adc_sampler = adc_sampler;
+        channel->channel = index;
+        if (settings->sample_interval_millisecs[index] == 0)
+        {
+            continue;
+        }
+
+        channel->samples = calloc(ADC_HISTORY_LENGTH, sizeof *channel->samples);
+        if (channel->samples == NULL)
+        {
+            created_sampler = false;
+            goto done;
+        }
+        channel->sample_interval_millisecs = settings->sample_interval_millisecs[index];
+        channel->threshold = settings->threshold[index];
+        channel->hysteresis = settings->hysteresis[index];
+        /* Channels with the same interval stay in step with each
+         * other, so they are read in the same burst.
+         */
+        channel->next_sample_msecs = now_msecs + channel->sample_interval_millisecs;
+    }
+
+    adc_schedule_samples(adc_sampler);
+
+    created_sampler = true;
+
+done:
+    if (!created_sampler)
+    {
+        adc_sampler_free(adc_sampler);
+    }
+
+    return created_sampler ? adc_sampler : NULL;
+}
+
+void adc_sampler_free(adc_sampler_st * const adc_sampler)
+{
+    size_t index;
+
+    if (adc_sampler == NULL)
+    {
+        goto done;
+    }
+
+    /* The module must be freed first, so that any reads in progress
+     * have completed.
+     */
+    uloop_timeout_cancel(&adc_sampler->sample_timer);
+    for (index = 0; index < ADC_MAX_CHANNELS; index++)
+    {
+        free(adc_sampler->channels[index].samples);
+    }
+    free(adc_sampler);
+
+done:
+    return;
+}
@@ -0,0 +1,59 @@
+#ifndef __ADC_SAMPLER_H__
+#define __ADC_SAMPLER_H__
+
+#include "relay_module.h"
+#include "message_handler.h"
+
+#include <stdbool.h>
+
+/* Samples the ADC inputs on a single module, each at its own
+ * interval, and keeps the most recent samples of each so that they
+ * can be summarised without going to the module. Channels that are
+ * due at the same time are read together, so the reads go down the
+ * command pipeline as one burst.
+ */
+typedef struct adc_sampler_st adc_sampler_st;
+
+#define ADC_DEFAULT_SAMPLE_INTERVAL_MILLISECS 1000
+
+#define ADC_DEFAULT_THRESHOLD_HYSTERESIS 8
+
+/* The number of samples kept for each channel. */
+#define ADC_HISTORY_LENGTH 512
+
+/* A channel is above its threshold once a sample reaches the 
+ * threshold, and below it again once a sample drops below the 
+ * threshold less the hysteresis. 
+ */
+typedef struct adc_sampler_settings_st
+{
+    /* 0 for channels that aren't sampled. */
+    unsigned int sample_interval_millisecs[ADC_MAX_CHANNELS];
+    /* 0 for channels without a threshold. */
+    unsigned int threshold[ADC_MAX_CHANNELS];
+    unsigned int hysteresis[ADC_MAX_CHANNELS];
+} adc_sampler_settings_st;
+
+/* Parses a comma separated list of channels, each with an optional
+ * interval in milliseconds and threshold e.g. "0,1:5000,2:1000:512".
+ * Channels without an interval are sampled every
+ * ADC_DEFAULT_SAMPLE_INTERVAL_MILLISECS.
+ */
+bool adc_sampler_channels_from_string(char const * const string,
+                                      adc_sampler_settings_st * const settings);
+
+/* changed_cb is called when a channel crosses its threshold, and 
+ * with the first sample from each channel that has one. 
+ */
+adc_sampler_st * adc_sampler_create(relay_module_st * const relay_module,
+                                    adc_sampler_settings_st const * const settings,
+                                    state_changed_fn const changed_cb,
+                                    void * const changed_context);
+void adc_sampler_free(adc_sampler_st * const adc_sampler);
+
+bool adc_sampler_get_stats(adc_sampler_st const * const adc_sampler,
+                           unsigned int const channel,
+                           unsigned int const window_millisecs,
+                           adc_stats_st * const stats);
+
+#endif /* __ADC_SAMPLER_H__ */
@@ -0,0 +1,162 @@
+#include "address_resolver.h"
+#include "socket.h"
+
+#include <libubox/uloop.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The resolver is shared by uloop and the thread, and is freed by 
+ * whichever of them is done with it last. The thread can't be 
+ * stopped in the middle of getaddrinfo(), so a cancelled resolver 
+ * is left for the thread to free. 
+ */
+struct address_resolver_st
+{
+    unsigned int references;
+    char * name;
+    uint16_t port;
+    struct addrinfo * addresses;
+    int signal_fds[2]; /* The thread writes to [1] once it is done. */
+    struct uloop_fd fd;
+    address_resolved_fn resolved_cb;
+    void * user_context;
+};
+
+static void address_resolver_put(address_resolver_st * const resolver)
+{
+    if (__atomic_sub_fetch(&resolver->references, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        goto done;
+    }
+
+    if (resolver->addresses != NULL)
+    {
+        freeaddrinfo(resolver->addresses);
+    }
+    /* Both ends are closed here, so the thread never writes to a 
+     * pipe without a reader. 
+     */
+    if (resolver->signal_fds[0] >= 0)
+    {
+        close(resolver->signal_fds[0]);
+    }
+    if (resolver->signal_fds[1] >= 0)
+    {
+        close(resolver->signal_fds[1]);
+    }
+    free(resolver->name);
+    free(resolver);
+
+done:
+    return;
+}
+
+static void * address_resolver_thread(void * const arg)
+{
+    address_resolver_st * const resolver = arg;
+    char const signal = 0;
+
+    resolver->addresses = resolve_address(resolver->name, resolver->port);
+    TEMP_FAILURE_RETRY(write(resolver->signal_fds[1], &signal, sizeof signal));
+
+    address_resolver_put(resolver);
+
+    return NULL;
+}
+
+static void address_resolver_fd_handler(struct uloop_fd * const fd, unsigned int const events)
+{
+    address_resolver_st * const resolver = container_of(fd, address_resolver_st, fd);
+    struct addrinfo * const addresses = resolver->addresses;
+
+    /* The write to the pipe makes the addresses visible here. */
+    uloop_fd_delete(fd);
+    resolver->addresses = NULL;
+
+    resolver->resolved_cb(resolver->user_context, addresses);
+
+    address_resolver_put(resolver);
+}
+
+address_resolver_st * address_resolver_start(char const * const name,
+                                             uint16_t const port,
+                                             address_resolved_fn const resolved_cb,
+                                             void * const user_context)
+{
+    bool started_resolver;
+    address_resolver_st * const resolver = calloc(1, sizeof *resolver);
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (resolver == NULL)
+    {
+        started_resolver = false;
+        goto done;
+    }
+
+    resolver->references = 1;
+    resolver->signal_fds[0] = -1;
+    resolver->signal_fds[1] = -1;
+    resolver->port = port;
+    resolver->resolved_cb = resolved_cb;
+    resolver->user_context = user_context;
+
+    resolver->name = strdup(name);
+    if (resolver->name == NULL || pipe2(resolver->signal_fds, O_CLOEXEC) < 0)
+    {
+        started_resolver = false;
+        goto done;
+    }
+
+    resolver->fd.fd = resolver->signal_fds[0];
+    resolver->fd.cb = address_resolver_fd_handler;
+    if (uloop_fd_add(&resolver->fd, ULOOP_READ) < 0)
+    {
+        started_resolver = false;
+        goto done;
+    }
+
+    /* The thread holds its own reference. */
+    resolver->references++;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, address_resolver_thread, resolver) != 0)
+    {
+        resolver->references--;
+        uloop_fd_delete(&resolver->fd);
+        pthread_attr_destroy(&attr);
+        started_resolver = false;
+        goto done;
+    }
+    pthread_attr_destroy(&attr);
+
+    started_resolver = true;
+
+done:
+    if (!started_resolver && resolver != NULL)
+    {
+        address_resolver_put(resolver);
+    }
+
+    return started_resolver ? resolver : NULL;
+}
+
+void address_resolver_cancel(address_resolver_st * const resolver)
+{
+    if (resolver == NULL)
+    {
+        goto done;
+    }
+
+    uloop_fd_delete(&resolver->fd);
+    address_resolver_put(resolver);
+
+done:
+    return;
+}
@@ -0,0 +1,30 @@
+#ifndef __ADDRESS_RESOLVER_H__
+#define __ADDRESS_RESOLVER_H__
+
+#include <stdint.h>
+#include <netdb.h>
+
+/* Resolves an address without blocking uloop. getaddrinfo() can 
+ * take as long as the resolver's timeout when the DNS server is slow 
+ * or unreachable, so it is run on a thread of its own, which signals 
+ * uloop once it is done. 
+ */
+typedef struct address_resolver_st address_resolver_st;
+
+/* Called from uloop with the addresses, or NULL if the name couldn't 
+ * be resolved. The callee frees them with freeaddrinfo(). 
+ */
+typedef void (* address_resolved_fn)(void * const user_context, struct addrinfo * const addresses);
+
+/* Returns NULL if the resolution couldn't be started. The resolver 
+ * frees itself once resolved_cb has been called. 
+ */
+address_resolver_st * address_resolver_start(char const * const name,
+                                             uint16_t const port,
+                                             address_resolved_fn const resolved_cb,
+                                             void * const user_context);
+
+/* resolved_cb won't be called. */
+void address_resolver_cancel(address_resolver_st * const resolver);
+
+#endif /* __ADDRESS_RESOLVER_H__ */
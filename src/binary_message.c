@@ -0,0 +1,92 @@
+#include "binary_message.h"
+#include "relay_states.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Responses to requests are deferred until the module has accepted 
+ * (or failed to accept) the new relay states. 
+ */
+typedef struct deferred_binary_response_st
+{
+    uint32_t request_id;
+    binary_response_fn response_cb;
+    void * response_context;
+} deferred_binary_response_st;
+
+static void send_binary_response(uint32_t const request_id,
+                                 binary_status_t const status,
+                                 binary_response_fn const response_cb,
+                                 void * const response_context)
+{
+    binary_response_st const response =
+    {
+        .magic = BINARY_RESPONSE_MAGIC,
+        .status = status,
+        .request_id = request_id
+    };
+
+    response_cb(response_context, &response);
+}
+
+static void binary_set_state_done(void * const done_context, bool const success)
+{
+    deferred_binary_response_st * const deferred = done_context;
+
+    send_binary_response(deferred->request_id, 
+                         success ? BINARY_STATUS_OK : BINARY_STATUS_WRITE_FAILED, 
+                         deferred->response_cb, 
+                         deferred->response_context);
+    free(deferred);
+}
+
+void binary_respond_status(binary_request_st const * const request,
+                           binary_status_t const status,
+                           binary_response_fn const response_cb,
+                           void * const response_context)
+{
+    send_binary_response(request->request_id, status, response_cb, response_context);
+}
+
+void process_binary_request(binary_request_st const * const request,
+                            message_handler_st const * const handlers,
+                            void * const user_info,
+                            binary_response_fn const response_cb,
+                            void * const response_context)
+{
+    relay_states_st * relay_states = NULL;
+    deferred_binary_response_st * deferred;
+    uint64_t relays_bitmask;
+
+    if (handlers->set_state_handler == NULL || handlers->get_relay_count_handler == NULL)
+    {
+        binary_respond_status(request, BINARY_STATUS_INTERNAL_ERROR, response_cb, response_context);
+        goto done;
+    }
+
+    relays_bitmask = numato_relays_bitmask(handlers->get_relay_count_handler(user_info));
+    if (request->reserved != 0 || (request->mask & ~relays_bitmask) != 0)
+    {
+        binary_respond_status(request, BINARY_STATUS_INVALID_REQUEST, response_cb, response_context);
+        goto done;
+    }
+
+    relay_states = relay_states_create();
+    deferred = calloc(1, sizeof *deferred);
+    if (relay_states == NULL || deferred == NULL)
+    {
+        free(deferred);
+        binary_respond_status(request, BINARY_STATUS_INTERNAL_ERROR, response_cb, response_context);
+        goto done;
+    }
+    relay_states_set_states(relay_states, request->mask, request->states);
+
+    deferred->request_id = request->request_id;
+    deferred->response_cb = response_cb;
+    deferred->response_context = response_context;
+
+    handlers->set_state_handler(user_info, relay_states, binary_set_state_done, deferred);
+
+done:
+    relay_states_free(relay_states);
+}
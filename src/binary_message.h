@@ -0,0 +1,60 @@
+#ifndef __BINARY_MESSAGE_H__
+#define __BINARY_MESSAGE_H__
+
+#include "message_handler.h"
+
+#include <stdint.h>
+
+/* A compact alternative to the JSON requests, for clients that 
+ * change the relays often. Each request is a fixed size frame that 
+ * maps straight onto the relay states, and is answered with a fixed 
+ * size status frame. The clients are on the same machine, so the 
+ * fields are in its byte order. 
+ */
+
+#define BINARY_REQUEST_MAGIC 0xB5
+#define BINARY_RESPONSE_MAGIC 0xB6
+
+typedef struct binary_request_st
+{
+    uint8_t magic; /* BINARY_REQUEST_MAGIC */
+    uint8_t module; /* The module's position in the configuration, from 0. */
+    uint16_t reserved; /* Must be 0. */
+    uint32_t request_id; /* Returned in the response. */
+    uint64_t mask; /* Bit n is set if relay n is to be changed. */
+    uint64_t states; /* The new states of the relays in the mask. */
+} binary_request_st;
+
+typedef enum binary_status_t
+{
+    BINARY_STATUS_OK,
+    BINARY_STATUS_WRITE_FAILED, /* The module didn't accept the new relay states. */
+    BINARY_STATUS_UNKNOWN_MODULE,
+    BINARY_STATUS_INVALID_REQUEST, /* e.g. the mask includes relays the module doesn't have. */
+    BINARY_STATUS_INTERNAL_ERROR
+} binary_status_t;
+
+typedef struct binary_response_st
+{
+    uint8_t magic; /* BINARY_RESPONSE_MAGIC */
+    uint8_t status; /* A binary_status_t. */
+    uint16_t reserved;
+    uint32_t request_id;
+} binary_response_st;
+
+/* Called exactly once for each request, when it has completed. */
+typedef void (* binary_response_fn)(void * const response_context, binary_response_st const * const response);
+
+void process_binary_request(binary_request_st const * const request,
+                            message_handler_st const * const handlers,
+                            void * const user_info,
+                            binary_response_fn const response_cb,
+                            void * const response_context);
+
+/* Fails a request without processing it. */
+void binary_respond_status(binary_request_st const * const request,
+                           binary_status_t const status,
+                           binary_response_fn const response_cb,
+                           void * const response_context);
+
+#endif /* __BINARY_MESSAGE_H__ */
@@ -0,0 +1,500 @@
+#include "config.h"
+#include "debug.h"
+#include "relay_states.h"
+
+#include <json-c/json.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Example configuration file:
+ * {
+ *     "modules": [
+ *         {
+ *             "name": "rack1",
+ *             "address": "192.168.1.10",
+ *             "port": 23,
+ *             "username": "admin",
+ *             "password": "admin",
+ *             "relays": 32,
+ *             "coalesce_window_ms": 10,
+ *             "max_state_age_ms": 2000,
+ *             "reconcile_interval_s": 120,
+ *             "verify_writes": true,
+ *             "session": "keepalive",
+ *             "idle_timeout_ms": 20000,
+ *             "connect_timeout_ms": 5000,
+ *             "login_timeout_ms": 15000,
+ *             "command_timeout_ms": 5000,
+ *             "pipeline_depth": 4,
+ *             "gpio_inputs": [0, 1, 2, 3],
+ *             "gpio_outputs": [4, 5],
+ *             "gpio_poll_interval_ms": 1000,
+ *             "adc_channels": [
+ *                 { "channel": 0, "interval_ms": 1000, "threshold": 512, "hysteresis": 8 },
+ *                 { "channel": 1 }
+ *             ]
+ *         }
+ *     ]
+ * }
+ * port and the settings are optional. ADC channels without an 
+ * interval are sampled every second, and a change event is only 
+ * sent for channels with a threshold.
+ */
+static char const modules_field_name[] = "modules";
+static char const name_field_name[] = "name";
+static char const address_field_name[] = "address";
+static char const port_field_name[] = "port";
+static char const username_field_name[] = "username";
+static char const password_field_name[] = "password";
+static char const coalesce_window_field_name[] = "coalesce_window_ms";
+static char const maximum_state_age_field_name[] = "max_state_age_ms";
+static char const reconcile_interval_field_name[] = "reconcile_interval_s";
+static char const verify_writes_field_name[] = "verify_writes";
+static char const session_mode_field_name[] = "session";
+static char const idle_timeout_field_name[] = "idle_timeout_ms";
+static char const connect_timeout_field_name[] = "connect_timeout_ms";
+static char const login_timeout_field_name[] = "login_timeout_ms";
+static char const command_timeout_field_name[] = "command_timeout_ms";
+static char const pipeline_depth_field_name[] = "pipeline_depth";
+static char const relays_field_name[] = "relays";
+static char const gpio_inputs_field_name[] = "gpio_inputs";
+static char const gpio_outputs_field_name[] = "gpio_outputs";
+static char const gpio_poll_interval_field_name[] = "gpio_poll_interval_ms";
+static char const adc_channels_field_name[] = "adc_channels";
+static char const adc_channel_field_name[] = "channel";
+static char const adc_interval_field_name[] = "interval_ms";
+static char const adc_threshold_field_name[] = "threshold";
+static char const adc_hysteresis_field_name[] = "hysteresis";
+
+static char * get_string_field(json_object * const object, char const * const field_name)
+{
+    json_object * field;
+    char * value;
+
+    if (!json_object_object_get_ex(object, field_name, &field)
+        || json_object_get_type(field) != json_type_string)
+    {
+        value = NULL;
+        goto done;
+    }
+
+    value = strdup(json_object_get_string(field));
+
+done:
+    return value;
+}
+
+static void get_unsigned_field(json_object * const object,
+                               char const * const field_name,
+                               unsigned int * const value)
+{
+    json_object * field;
+
+    if (json_object_object_get_ex(object, field_name, &field)
+        && json_object_get_type(field) == json_type_int
+        && json_object_get_int(field) >= 0)
+    {
+        *value = json_object_get_int(field);
+    }
+}
+
+static void get_bool_field(json_object * const object,
+                           char const * const field_name,
+                           bool * const value)
+{
+    json_object * field;
+
+    if (json_object_object_get_ex(object, field_name, &field)
+        && json_object_get_type(field) == json_type_boolean)
+    {
+        *value = json_object_get_boolean(field);
+    }
+}
+
+/* GPIO lines are given as an array of GPIO numbers. */
+static bool get_gpio_lines_field(json_object * const object,
+                                 char const * const field_name,
+                                 unsigned int * const gpio_bitmask)
+{
+    bool parsed_field;
+    json_object * field;
+    unsigned int bitmask = 0;
+    size_t index;
+
+    if (!json_object_object_get_ex(object, field_name, &field))
+    {
+        parsed_field = true;
+        goto done;
+    }
+    if (json_object_get_type(field) != json_type_array)
+    {
+        parsed_field = false;
+        goto done;
+    }
+
+    for (index = 0; index < json_object_array_length(field); index++)
+    {
+        json_object * const line = json_object_array_get_idx(field, index);
+        int gpio;
+
+        if (json_object_get_type(line) != json_type_int)
+        {
+            parsed_field = false;
+            goto done;
+        }
+        gpio = json_object_get_int(line);
+        if (gpio < 0 || gpio >= (int)(sizeof bitmask * 8))
+        {
+            parsed_field = false;
+            goto done;
+        }
+        bitmask |= 1U << gpio;
+    }
+
+    *gpio_bitmask = bitmask;
+    parsed_field = true;
+
+done:
+    return parsed_field;
+}
+
+static bool get_adc_channels_field(json_object * const object,
+                                   char const * const field_name,
+                                   adc_sampler_settings_st * const adc_settings)
+{
+    bool parsed_field;
+    json_object * field;
+    adc_sampler_settings_st channels;
+    size_t index;
+
+    if (!json_object_object_get_ex(object, field_name, &field))
+    {
+        parsed_field = true;
+        goto done;
+    }
+    if (json_object_get_type(field) != json_type_array)
+    {
+        parsed_field = false;
+        goto done;
+    }
+
+    memset(&channels, 0, sizeof channels);
+
+    for (index = 0; index < json_object_array_length(field); index++)
+    {
+        json_object * const channel_object = json_object_array_get_idx(field, index);
+        unsigned int channel = ADC_MAX_CHANNELS;
+        unsigned int interval = ADC_DEFAULT_SAMPLE_INTERVAL_MILLISECS;
+        unsigned int threshold = 0;
+        unsigned int hysteresis = ADC_DEFAULT_THRESHOLD_HYSTERESIS;
+
+        get_unsigned_field(channel_object, adc_channel_field_name, &channel);
+        get_unsigned_field(channel_object, adc_interval_field_name, &interval);
+        get_unsigned_field(channel_object, adc_threshold_field_name, &threshold);
+        get_unsigned_field(channel_object, adc_hysteresis_field_name, &hysteresis);
+        if (channel >= ADC_MAX_CHANNELS || interval == 0)
+        {
+            parsed_field = false;
+            goto done;
+        }
+        channels.sample_interval_millisecs[channel] = interval;
+        channels.threshold[channel] = threshold;
+        channels.hysteresis[channel] = hysteresis;
+    }
+
+    *adc_settings = channels;
+    parsed_field = true;
+
+done:
+    return parsed_field;
+}
+
+/* The name forms part of the ubus object name, so only allow 
+ * simple names. 
+ */
+static bool module_name_is_valid(char const * const name)
+{
+    bool is_valid;
+    char const * ch;
+
+    if (*name == '\0')
+    {
+        is_valid = false;
+        goto done;
+    }
+
+    for (ch = name; *ch != '\0'; ch++)
+    {
+        if (!isalnum((unsigned char)*ch) && *ch != '_' && *ch != '-')
+        {
+            is_valid = false;
+            goto done;
+        }
+    }
+
+    is_valid = true;
+
+done:
+    return is_valid;
+}
+
+static void module_config_free(module_config_st * const module)
+{
+    free(module->name);
+    free((char *)module->relay_module_info.address);
+    free((char *)module->relay_module_info.username);
+    free((char *)module->relay_module_info.password);
+}
+
+static bool parse_module(json_object * const object,
+                         module_config_st * const module,
+                         relay_controller_settings_st const * const default_settings)
+{
+    bool parsed_module;
+    unsigned int port = TELNET_PORT;
+    char * session_mode = NULL;
+
+    module->name = get_string_field(object, name_field_name);
+    module->relay_module_info.address = get_string_field(object, address_field_name);
+    module->relay_module_info.username = get_string_field(object, username_field_name);
+    module->relay_module_info.password = get_string_field(object, password_field_name);
+
+    if (module->name == NULL
+        || module->relay_module_info.address == NULL
+        || module->relay_module_info.username == NULL
+        || module->relay_module_info.password == NULL)
+    {
+        DPRINTF("module configuration is missing a required field\n");
+        parsed_module = false;
+        goto done;
+    }
+
+    if (!module_name_is_valid(module->name))
+    {
+        DPRINTF("invalid module name: '%s'\n", module->name);
+        parsed_module = false;
+        goto done;
+    }
+
+    get_unsigned_field(object, port_field_name, &port);
+    if (port == 0 || port > UINT16_MAX)
+    {
+        DPRINTF("%s: invalid port: %u\n", module->name, port);
+        parsed_module = false;
+        goto done;
+    }
+    module->relay_module_info.port = port;
+
+    module->settings = *default_settings;
+    get_unsigned_field(object, coalesce_window_field_name, &module->settings.coalesce_window_millisecs);
+    get_unsigned_field(object, maximum_state_age_field_name, &module->settings.maximum_state_age_millisecs);
+    get_unsigned_field(object, reconcile_interval_field_name, &module->settings.reconcile_interval_seconds);
+    get_bool_field(object, verify_writes_field_name, &module->settings.verify_writes);
+    get_unsigned_field(object, idle_timeout_field_name, &module->settings.module_settings.idle_millisecs);
+    get_unsigned_field(object, connect_timeout_field_name, &module->settings.module_settings.connect_millisecs);
+    get_unsigned_field(object, login_timeout_field_name, &module->settings.module_settings.login_millisecs);
+    get_unsigned_field(object, command_timeout_field_name, &module->settings.module_settings.command_millisecs);
+    get_unsigned_field(object, pipeline_depth_field_name, &module->settings.module_settings.pipeline_depth);
+
+    get_unsigned_field(object, relays_field_name, &module->settings.module_settings.num_relays);
+    if (numato_model_find(module->settings.module_settings.num_relays) == NULL)
+    {
+        DPRINTF("%s: no module has %u relays\n", module->name, module->settings.module_settings.num_relays);
+        parsed_module = false;
+        goto done;
+    }
+
+    get_unsigned_field(object, gpio_poll_interval_field_name, &module->settings.gpio_settings.poll_interval_millisecs);
+
+    if (!get_gpio_lines_field(object, gpio_inputs_field_name, &module->settings.gpio_settings.inputs_bitmask)
+        || !get_gpio_lines_field(object, gpio_outputs_field_name, &module->settings.gpio_settings.outputs_bitmask))
+    {
+        DPRINTF("%s: invalid GPIO lines\n", module->name);
+        parsed_module = false;
+        goto done;
+    }
+    if ((module->settings.gpio_settings.inputs_bitmask & module->settings.gpio_settings.outputs_bitmask) != 0)
+    {
+        DPRINTF("%s: GPIO lines can't be both inputs and outputs\n", module->name);
+        parsed_module = false;
+        goto done;
+    }
+
+    if (!get_adc_channels_field(object, adc_channels_field_name, &module->settings.adc_settings))
+    {
+        DPRINTF("%s: invalid ADC channels\n", module->name);
+        parsed_module = false;
+        goto done;
+    }
+
+    session_mode = get_string_field(object, session_mode_field_name);
+    if (session_mode != NULL
+        && !relay_module_session_mode_from_string(session_mode, &module->settings.module_settings.session_mode))
+    {
+        DPRINTF("%s: unknown session mode: '%s'\n", module->name, session_mode);
+        parsed_module = false;
+        goto done;
+    }
+
+    parsed_module = true;
+
+done:
+    free(session_mode);
+
+    return parsed_module;
+}
+
+static bool module_name_is_unique(config_st const * const config, char const * const name)
+{
+    bool is_unique;
+    size_t index;
+
+    for (index = 0; index < config->num_modules; index++)
+    {
+        if (strcmp(config->modules[index].name, name) == 0)
+        {
+            is_unique = false;
+            goto done;
+        }
+    }
+
+    is_unique = true;
+
+done:
+    return is_unique;
+}
+
+config_st * config_load(char const * const filename,
+                        relay_controller_settings_st const * const default_settings)
+{
+    bool loaded_config;
+    config_st * config = NULL;
+    json_object * root;
+    json_object * modules;
+    size_t num_modules;
+    size_t index;
+
+    root = json_object_from_file(filename);
+    if (root == NULL)
+    {
+        DPRINTF("failed to read configuration file: %s\n", filename);
+        loaded_config = false;
+        goto done;
+    }
+
+    if (!json_object_object_get_ex(root, modules_field_name, &modules)
+        || json_object_get_type(modules) != json_type_array)
+    {
+        DPRINTF("configuration file has no '%s' array\n", modules_field_name);
+        loaded_config = false;
+        goto done;
+    }
+    num_modules = json_object_array_length(modules);
+
+    config = calloc(1, sizeof *config);
+    if (config == NULL)
+    {
+        loaded_config = false;
+        goto done;
+    }
+    config->modules = calloc(num_modules, sizeof *config->modules);
+    if (config->modules == NULL && num_modules > 0)
+    {
+        loaded_config = false;
+        goto done;
+    }
+
+    for (index = 0; index < num_modules; index++)
+    {
+        module_config_st * const module = &config->modules[index];
+
+        if (!parse_module(json_object_array_get_idx(modules, index), module, default_settings))
+        {
+            module_config_free(module);
+            loaded_config = false;
+            goto done;
+        }
+        if (!module_name_is_unique(config, module->name))
+        {
+            DPRINTF("duplicate module name: '%s'\n", module->name);
+            module_config_free(module);
+            loaded_config = false;
+            goto done;
+        }
+        config->num_modules++;
+    }
+
+    loaded_config = true;
+
+done:
+    json_object_put(root);
+    if (!loaded_config)
+    {
+        config_free(config);
+        config = NULL;
+    }
+
+    return config;
+}
+
+config_st * config_create_single(relay_module_info_st const * const relay_module_info,
+                                 relay_controller_settings_st const * const settings)
+{
+    bool created_config;
+    config_st * const config = calloc(1, sizeof *config);
+
+    if (config == NULL)
+    {
+        created_config = false;
+        goto done;
+    }
+    config->modules = calloc(1, sizeof *config->modules);
+    if (config->modules == NULL)
+    {
+        created_config = false;
+        goto done;
+    }
+    config->num_modules = 1;
+
+    module_config_st * const module = &config->modules[0];
+
+    module->relay_module_info.address = strdup(relay_module_info->address);
+    module->relay_module_info.port = relay_module_info->port;
+    module->relay_module_info.username = strdup(relay_module_info->username);
+    module->relay_module_info.password = strdup(relay_module_info->password);
+    module->settings = *settings;
+
+    created_config = module->relay_module_info.address != NULL
+                     && module->relay_module_info.username != NULL
+                     && module->relay_module_info.password != NULL;
+
+done:
+    if (!created_config)
+    {
+        config_free(config);
+    }
+
+    return created_config ? config : NULL;
+}
+
+void config_free(config_st * const config)
+{
+    size_t index;
+
+    if (config == NULL)
+    {
+        goto done;
+    }
+
+    for (index = 0; index < config->num_modules; index++)
+    {
+        module_config_free(&config->modules[index]);
+    }
+    free(config->modules);
+    free(config);
+
+done:
+    return;
+}
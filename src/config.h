@@ -0,0 +1,34 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "relay_module.h"
+#include "relay_controller.h"
+
+#include <stddef.h>
+
+typedef struct module_config_st
+{
+    char * name; /* NULL for a module given on the command line. */
+    relay_module_info_st relay_module_info;
+    relay_controller_settings_st settings;
+} module_config_st;
+
+typedef struct config_st
+{
+    module_config_st * modules;
+    size_t num_modules;
+} config_st;
+
+/* Modules that don't specify their own settings get the default 
+ * settings. 
+ */
+config_st * config_load(char const * const filename,
+                        relay_controller_settings_st const * const default_settings);
+/* Creates the configuration for a single module given on the 
+ * command line. 
+ */
+config_st * config_create_single(relay_module_info_st const * const relay_module_info,
+                                 relay_controller_settings_st const * const settings);
+void config_free(config_st * const config);
+
+#endif /* __CONFIG_H__ */
@@ -0,0 +1,434 @@
+#include "gpio_lines.h"
+#include "debug.h"
+
+#include <libubox/uloop.h>
+#include <libubox/list.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_GPIO_LINES (sizeof(unsigned int) * 8)
+
+struct gpio_lines_st
+{
+    char const * name;
+    relay_module_st * relay_module;
+    unsigned int inputs_bitmask;
+    unsigned int outputs_bitmask;
+
+    unsigned int poll_interval_millisecs;
+    struct uloop_timeout poll_timer;
+    bool read_in_progress;
+    bool input_states_valid; /* True if the last read succeeded. */
+    unsigned int input_states; /* Indexed by GPIO number. */
+    struct list_head waiting_reads; /* Waiting for the inputs to be read from the module. */
+    bool input_states_known; /* True once the inputs have been read. */
+    state_changed_fn changed_cb;
+    void * changed_context;
+
+    unsigned int output_states; /* Indexed by GPIO number. */
+    unsigned int outputs_set; /* The outputs that have been set since the daemon started. */
+};
+
+typedef struct gpio_read_request_st
+{
+    struct list_head list;
+    get_states_done_fn done_cb;
+    void * done_context;
+} gpio_read_request_st;
+
+typedef struct gpio_output_write_st
+{
+    gpio_lines_st * gpio_lines;
+    unsigned int gpio;
+    bool state;
+    set_state_done_fn done_cb;
+    void * done_context;
+} gpio_output_write_st;
+
+/* Returns the GPIO number of the index'th line in gpio_bitmask. */
+static bool gpio_from_index(unsigned int const gpio_bitmask,
+                            unsigned int const index,
+                            unsigned int * const gpio)
+{
+    bool found_gpio;
+    unsigned int remaining = index;
+    unsigned int line;
+
+    for (line = 0; line < MAX_GPIO_LINES; line++)
+    {
+        if ((gpio_bitmask & (1U << line)) == 0)
+        {
+            continue;
+        }
+        if (remaining == 0)
+        {
+            *gpio = line;
+            found_gpio = true;
+            goto done;
+        }
+        remaining--;
+    }
+
+    found_gpio = false;
+
+done:
+    return found_gpio;
+}
+
+/* Converts states indexed by GPIO number to states indexed by the
+ * position of each line in gpio_bitmask.
+ */
+static unsigned int states_by_index(unsigned int const gpio_bitmask, unsigned int const gpio_states)
+{
+    unsigned int states = 0;
+    unsigned int index = 0;
+    unsigned int line;
+
+    for (line = 0; line < MAX_GPIO_LINES; line++)
+    {
+        if ((gpio_bitmask & (1U << line)) == 0)
+        {
+            continue;
+        }
+        if ((gpio_states & (1U << line)) != 0)
+        {
+            states |= 1U << index;
+        }
+        index++;
+    }
+
+    return states;
+}
+
+static void gpio_read_requests_done(struct list_head * const requests,
+                                    bool const success,
+                                    unsigned int const states_bitmask)
+{
+    while (!list_empty(requests))
+    {
+        gpio_read_request_st * const request =
+            list_first_entry(requests, gpio_read_request_st, list);
+
+        list_del(&request->list);
+        request->done_cb(request->done_context, success, states_bitmask);
+        free(request);
+    }
+}
+
+static void gpio_inputs_changed(gpio_lines_st * const gpio_lines, unsigned int const states_bitmask)
+{
+    unsigned int const all_inputs = states_by_index(gpio_lines->inputs_bitmask, gpio_lines->inputs_bitmask);
+    state_change_st change =
+    {
+        .type = STATE_CHANGE_GPIO_INPUTS,
+        .states = states_by_index(gpio_lines->inputs_bitmask, states_bitmask)
+    };
+
+    /* The first read changes all of the inputs from unknown. */
+    change.changed =
+        gpio_lines->input_states_known
+        ? states_by_index(gpio_lines->inputs_bitmask, states_bitmask ^ gpio_lines->input_states)
+        : all_inputs;
+
+    if (change.changed != 0 && gpio_lines->changed_cb != NULL)
+    {
+        gpio_lines->changed_cb(gpio_lines->changed_context, &change);
+    }
+}
+
+static void gpio_inputs_read_done(void * const user_context,
+                                  bool const success,
+                                  uint64_t const gpio_states)
+{
+    gpio_lines_st * const gpio_lines = user_context;
+    unsigned int const states_bitmask = gpio_states;
+    LIST_HEAD(requests);
+
+    gpio_lines->read_in_progress = false;
+    gpio_lines->input_states_valid = success;
+    if (success)
+    {
+        gpio_inputs_changed(gpio_lines, states_bitmask);
+        gpio_lines->input_states = states_bitmask;
+        gpio_lines->input_states_known = true;
+    }
+
+    if (gpio_lines->poll_interval_millisecs > 0)
+    {
+        uloop_timeout_set(&gpio_lines->poll_timer, gpio_lines->poll_interval_millisecs);
+    }
+
+    /* Requests that arrive while the callbacks are being run will
+     * need a new read.
+     */
+    list_splice_tail_init(&gpio_lines->waiting_reads, &requests);
+    gpio_read_requests_done(&requests,
+                            success,
+                            states_by_index(gpio_lines->inputs_bitmask, states_bitmask));
+}
+
+static void gpio_read_inputs(gpio_lines_st * const gpio_lines,
+                             relay_module_priority_t const priority)
+{
+    if (gpio_lines->read_in_progress)
+    {
+        goto done;
+    }
+
+    /* All of the inputs are read in one burst, and everyone waiting
+     * gets the result of that read.
+     */
+    gpio_lines->read_in_progress = true;
+    if (!relay_module_read_gpios(gpio_lines->relay_module,
+                                 priority,
+                                 gpio_lines->inputs_bitmask,
+                                 gpio_inputs_read_done,
+                                 gpio_lines))
+    {
+        gpio_inputs_read_done(gpio_lines, false, 0);
+    }
+
+done:
+    return;
+}
+
+static void gpio_poll_timer_handler(struct uloop_timeout * const timeout)
+{
+    gpio_lines_st * const gpio_lines = container_of(timeout, gpio_lines_st, poll_timer);
+
+    gpio_read_inputs(gpio_lines, RELAY_MODULE_PRIORITY_TELEMETRY);
+}
+
+static void gpio_get_inputs(gpio_lines_st * const gpio_lines,
+                            get_states_done_fn const done_cb,
+                            void * const done_context)
+{
+    gpio_read_request_st * request;
+
+    if (gpio_lines->poll_interval_millisecs > 0 && gpio_lines->input_states_valid)
+    {
+        done_cb(done_context,
+                true,
+                states_by_index(gpio_lines->inputs_bitmask, gpio_lines->input_states));
+        goto done;
+    }
+
+    request = calloc(1, sizeof *request);
+    if (request == NULL)
+    {
+        done_cb(done_context, false, 0);
+        goto done;
+    }
+    request->done_cb = done_cb;
+    request->done_context = done_context;
+    list_add_tail(&request->list, &gpio_lines->waiting_reads);
+
+    gpio_read_inputs(gpio_lines, RELAY_MODULE_PRIORITY_USER);
+
+done:
+    return;
+}
+
+void gpio_lines_get_states(gpio_lines_st * const gpio_lines,
+                           gpio_direction_t const direction,
+                           get_states_done_fn const done_cb,
+                           void * const done_context)
+{
+    if (direction == GPIO_DIRECTION_INPUT)
+    {
+        gpio_get_inputs(gpio_lines, done_cb, done_context);
+    }
+    else
+    {
+        done_cb(done_context,
+                true,
+                states_by_index(gpio_lines->outputs_bitmask, gpio_lines->output_states));
+    }
+}
+
+static void gpio_output_write_done(void * const user_context,
+                                   bool const success,
+                                   char const * const response)
+{
+    gpio_output_write_st * const write = user_context;
+    gpio_lines_st * const gpio_lines = write->gpio_lines;
+    unsigned int const gpio_bit = 1U << write->gpio;
+
+    if (success)
+    {
+        if (write->state)
+        {
+            gpio_lines->output_states |= gpio_bit;
+        }
+        else
+        {
+            gpio_lines->output_states &= ~gpio_bit;
+        }
+        gpio_lines->outputs_set |= gpio_bit;
+    }
+
+    if (write->done_cb != NULL)
+    {
+        write->done_cb(write->done_context, success);
+    }
+    free(write);
+}
+
+void gpio_lines_set_output(gpio_lines_st * const gpio_lines,
+                           unsigned int const output,
+                           bool const state,
+                           set_state_done_fn const done_cb,
+                           void * const done_context)
+{
+    bool submitted;
+    gpio_output_write_st * write;
+    unsigned int gpio;
+
+    if (!gpio_from_index(gpio_lines->outputs_bitmask, output, &gpio))
+    {
+        submitted = false;
+        goto done;
+    }
+
+    write = calloc(1, sizeof *write);
+    if (write == NULL)
+    {
+        submitted = false;
+        goto done;
+    }
+    write->gpio_lines = gpio_lines;
+    write->gpio = gpio;
+    write->state = state;
+    write->done_cb = done_cb;
+    write->done_context = done_context;
+
+    submitted = relay_module_write_gpio(gpio_lines->relay_module,
+                                        RELAY_MODULE_PRIORITY_USER,
+                                        gpio,
+                                        state,
+                                        gpio_output_write_done,
+                                        write);
+    if (!submitted)
+    {
+        free(write);
+    }
+
+done:
+    /* Otherwise gpio_output_write_done() reports the result. */
+    if (!submitted && done_cb != NULL)
+    {
+        done_cb(done_context, false);
+    }
+}
+
+void gpio_lines_module_connected(gpio_lines_st * const gpio_lines)
+{
+    unsigned int gpio;
+
+    for (gpio = 0; gpio < MAX_GPIO_LINES; gpio++)
+    {
+        unsigned int const gpio_bit = 1U << gpio;
+
+        if ((gpio_lines->outputs_set & gpio_bit) != 0)
+        {
+            relay_module_write_gpio(gpio_lines->relay_module,
+                                    RELAY_MODULE_PRIORITY_RECONCILE,
+                                    gpio,
+                                    (gpio_lines->output_states & gpio_bit) != 0,
+                                    NULL,
+                                    NULL);
+        }
+    }
+}
+
+size_t gpio_lines_count(gpio_lines_st const * const gpio_lines, gpio_direction_t const direction)
+{
+    unsigned int const gpio_bitmask =
+        (direction == GPIO_DIRECTION_INPUT) ? gpio_lines->inputs_bitmask : gpio_lines->outputs_bitmask;
+
+    return __builtin_popcount(gpio_bitmask);
+}
+
+bool gpio_lines_from_string(char const * const string, unsigned int * const gpio_bitmask)
+{
+    bool parsed_lines;
+    char const * next = string;
+    unsigned int bitmask = 0;
+
+    while (*next != '\0')
+    {
+        char * end;
+        unsigned long const gpio = strtoul(next, &end, 10);
+
+        if (end == next || gpio >= MAX_GPIO_LINES || (*end != ',' && *end != '\0'))
+        {
+            parsed_lines = false;
+            goto done;
+        }
+        bitmask |= 1U << gpio;
+
+        next = (*end == ',') ? end + 1 : end;
+    }
+
+    *gpio_bitmask = bitmask;
+    parsed_lines = true;
+
+done:
+    return parsed_lines;
+}
+
+gpio_lines_st * gpio_lines_create(char const * const name,
+                                  relay_module_st * const relay_module,
+                                  gpio_lines_settings_st const * const settings,
+                                  state_changed_fn const changed_cb,
+                                  void * const changed_context)
+{
+    gpio_lines_st * const gpio_lines = calloc(1, sizeof *gpio_lines);
+
+    if (gpio_lines == NULL)
+    {
+        goto done;
+    }
+
+    gpio_lines->name = name;
+    gpio_lines->relay_module = relay_module;
+    gpio_lines->inputs_bitmask = settings->inputs_bitmask;
+    gpio_lines->outputs_bitmask = settings->outputs_bitmask & ~settings->inputs_bitmask;
+    if (gpio_lines->outputs_bitmask != settings->outputs_bitmask)
+    {
+        DPRINTF("%s: GPIO lines used as inputs can't also be outputs\n", name);
+    }
+    gpio_lines->poll_interval_millisecs = settings->poll_interval_millisecs;
+    gpio_lines->poll_timer.cb = gpio_poll_timer_handler;
+    gpio_lines->changed_cb = changed_cb;
+    gpio_lines->changed_context = changed_context;
+    INIT_LIST_HEAD(&gpio_lines->waiting_reads);
+
+    if (gpio_lines->inputs_bitmask != 0 && gpio_lines->poll_interval_millisecs > 0)
+    {
+        uloop_timeout_set(&gpio_lines->poll_timer, gpio_lines->poll_interval_millisecs);
+    }
+
+done:
+    return gpio_lines;
+}
+
+void gpio_lines_free(gpio_lines_st * const gpio_lines)
+{
+    if (gpio_lines == NULL)
+    {
+        goto done;
+    }
+
+    /* The module must be freed first, so that any read in progress
+     * has completed.
+     */
+    uloop_timeout_cancel(&gpio_lines->poll_timer);
+    gpio_read_requests_done(&gpio_lines->waiting_reads, false, 0);
+    free(gpio_lines);
+
+done:
+    return;
+}
@@ -0,0 +1,54 @@
+#ifndef __GPIO_LINES_H__
+#define __GPIO_LINES_H__
+
+#include "relay_module.h"
+#include "message_handler.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Keeps track of the GPIO lines on a single module. The inputs are
+ * polled, so requests for them are usually answered without
+ * waiting for the module. The module makes a line an input when it
+ * is read, so the outputs are never read back, and their states are
+ * those they were last set to.
+ */
+typedef struct gpio_lines_st gpio_lines_st;
+
+typedef struct gpio_lines_settings_st
+{
+    unsigned int inputs_bitmask; /* Bit n is set if GPIO n is used as an input. */
+    unsigned int outputs_bitmask; /* Bit n is set if GPIO n is used as an output. */
+    unsigned int poll_interval_millisecs; /* 0 to only read the inputs when asked. */
+} gpio_lines_settings_st;
+
+/* Parses a comma separated list of GPIO numbers e.g. "0,1,4". */
+bool gpio_lines_from_string(char const * const string, unsigned int * const gpio_bitmask);
+
+/* changed_cb is called when a poll finds that the inputs have 
+ * changed. 
+ */
+gpio_lines_st * gpio_lines_create(char const * const name,
+                                  relay_module_st * const relay_module,
+                                  gpio_lines_settings_st const * const settings,
+                                  state_changed_fn const changed_cb,
+                                  void * const changed_context);
+void gpio_lines_free(gpio_lines_st * const gpio_lines);
+
+/* Sets the outputs again, in case the module has been reset. */
+void gpio_lines_module_connected(gpio_lines_st * const gpio_lines);
+
+size_t gpio_lines_count(gpio_lines_st const * const gpio_lines, gpio_direction_t const direction);
+
+void gpio_lines_get_states(gpio_lines_st * const gpio_lines,
+                           gpio_direction_t const direction,
+                           get_states_done_fn const done_cb,
+                           void * const done_context);
+
+void gpio_lines_set_output(gpio_lines_st * const gpio_lines,
+                           unsigned int const output,
+                           bool const state,
+                           set_state_done_fn const done_cb,
+                           void * const done_context);
+
+#endif /* __GPIO_LINES_H__ */
@@ -0,0 +1,111 @@
+#include "json_reader.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct json_reader_st
+{
+    struct json_tokener * tok;
+    char buffer[JSON_READER_BUFFER_SIZE];
+    size_t length; /* The number of bytes in the buffer. */
+    size_t parsed; /* The number of those bytes given to the tokener. */
+};
+
+json_reader_st * json_reader_create(void)
+{
+    json_reader_st * reader = calloc(1, sizeof *reader);
+
+    if (reader == NULL)
+    {
+        goto done;
+    }
+
+    reader->tok = json_tokener_new();
+    if (reader->tok == NULL)
+    {
+        free(reader);
+        reader = NULL;
+        goto done;
+    }
+
+done:
+    return reader;
+}
+
+void json_reader_free(json_reader_st * const reader)
+{
+    if (reader == NULL)
+    {
+        goto done;
+    }
+
+    json_tokener_free(reader->tok);
+    free(reader);
+
+done:
+    return;
+}
+
+ssize_t json_reader_fill(json_reader_st * const reader, int const fd)
+{
+    ssize_t bytes_read;
+
+    if (reader->parsed == reader->length)
+    {
+        /* The tokener keeps its own copy of a partial message, so
+         * the bytes it has been given are no longer needed.
+         */
+        reader->length = 0;
+        reader->parsed = 0;
+    }
+
+    bytes_read = TEMP_FAILURE_RETRY(read(fd,
+                                         &reader->buffer[reader->length],
+                                         sizeof reader->buffer - reader->length));
+    if (bytes_read > 0)
+    {
+        reader->length += bytes_read;
+    }
+
+    return bytes_read;
+}
+
+json_object * json_reader_next(json_reader_st * const reader, bool * const failed)
+{
+    json_object * message;
+    size_t const remaining = reader->length - reader->parsed;
+
+    *failed = false;
+
+    if (remaining == 0)
+    {
+        message = NULL;
+        goto done;
+    }
+
+    message = json_tokener_parse_ex(reader->tok, &reader->buffer[reader->parsed], remaining);
+
+    if (message != NULL)
+    {
+        /* Anything after the end of the message belongs to the next
+         * one.
+         */
+        reader->parsed += reader->tok->char_offset;
+        json_tokener_reset(reader->tok);
+    }
+    else if (reader->tok->err == json_tokener_continue)
+    {
+        reader->parsed = reader->length;
+    }
+    else
+    {
+        *failed = true;
+        reader->length = 0;
+        reader->parsed = 0;
+        json_tokener_reset(reader->tok);
+    }
+
+done:
+    return message;
+}
@@ -0,0 +1,34 @@
+#ifndef __JSON_READER_H__
+#define __JSON_READER_H__
+
+#include <json-c/json.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define JSON_READER_BUFFER_SIZE 4096
+
+/* Splits a stream of concatenated JSON messages into separate
+ * messages. Whatever has arrived is read in one go and handed to the
+ * tokener a buffer at a time, and any bytes following a complete
+ * message are kept for the next one.
+ */
+typedef struct json_reader_st json_reader_st;
+
+json_reader_st * json_reader_create(void);
+void json_reader_free(json_reader_st * const reader);
+
+/* Reads whatever is available on fd into the reader's buffer.
+ * Returns the number of bytes read, 0 at EOF, or -1 on error. Only
+ * call this once json_reader_next() has returned NULL, as the
+ * buffer is only emptied once all of it has been parsed.
+ */
+ssize_t json_reader_fill(json_reader_st * const reader, int const fd);
+
+/* Returns the next complete message, or NULL if more bytes are
+ * needed first. failed is set if the stream isn't valid JSON, in
+ * which case the buffered bytes are dropped.
+ */
+json_object * json_reader_next(json_reader_st * const reader, bool * const failed);
+
+#endif /* __JSON_READER_H__ */
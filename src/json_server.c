@@ -0,0 +1,648 @@
+#include "json_server.h"
+#include "json_reader.h"
+#include "message.h"
+#include "binary_message.h"
+#include "socket_server.h"
+#include "debug.h"
+
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Connections beyond this many are closed as soon as they are 
+ * accepted. 
+ */
+#define JSON_SERVER_MAX_CLIENTS 32
+
+/* A client that stops reading its responses is disconnected once 
+ * this many bytes are waiting to be sent to it. 
+ */
+#define JSON_SERVER_MAX_OUTPUT_BYTES 65536
+
+/* The number of binary requests that are read in one go. */
+#define JSON_SERVER_BINARY_REQUESTS_PER_READ 32
+
+/* Each client speaks either JSON or the binary protocol, which is 
+ * decided by the first byte it sends. 
+ */
+typedef enum client_protocol_t
+{
+    CLIENT_PROTOCOL_UNKNOWN,
+    CLIENT_PROTOCOL_JSON,
+    CLIENT_PROTOCOL_BINARY
+} client_protocol_t;
+
+typedef struct json_module_st
+{
+    struct list_head list;
+    char * name; /* NULL for a module given on the command line. */
+    message_handler_st const * handlers;
+    void * user_info;
+} json_module_st;
+
+/* A client is freed once its connection is closed and nothing 
+ * refers to it. Each request that hasn't completed yet holds a 
+ * reference, as does the open connection. 
+ */
+typedef struct json_client_st
+{
+    struct list_head list;
+    struct uloop_fd fd;
+    client_protocol_t protocol;
+    json_reader_st * reader;
+    /* Binary requests are read whole, so only the last of the 
+     * requests read may be incomplete. 
+     */
+    uint8_t binary_input[JSON_SERVER_BINARY_REQUESTS_PER_READ * sizeof(binary_request_st)];
+    size_t binary_input_length;
+    char * output; /* Responses that couldn't be sent straight away. */
+    size_t output_length;
+    unsigned int references;
+    bool closed;
+} json_client_st;
+
+static LIST_HEAD(json_modules);
+static LIST_HEAD(json_clients);
+static size_t num_json_clients;
+static struct uloop_fd listen_fd = { .fd = -1 };
+static char * listen_socket_name;
+
+static bool set_nonblocking(int const fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0;
+}
+
+static json_module_st * json_module_find(char const * const module_name)
+{
+    json_module_st * json_module;
+
+    if (module_name == NULL)
+    {
+        json_module = list_empty(&json_modules) 
+            ? NULL : list_first_entry(&json_modules, json_module_st, list);
+        goto done;
+    }
+
+    list_for_each_entry(json_module, &json_modules, list)
+    {
+        if (json_module->name != NULL && strcmp(json_module->name, module_name) == 0)
+        {
+            goto done;
+        }
+    }
+    json_module = NULL;
+
+done:
+    return json_module;
+}
+
+static json_module_st * json_module_at(unsigned int const module_index)
+{
+    json_module_st * json_module;
+    unsigned int index = 0;
+
+    list_for_each_entry(json_module, &json_modules, list)
+    {
+        if (index == module_index)
+        {
+            goto done;
+        }
+        index++;
+    }
+    json_module = NULL;
+
+done:
+    return json_module;
+}
+
+static void json_client_put(json_client_st * const client)
+{
+    client->references--;
+    if (client->references == 0)
+    {
+        json_reader_free(client->reader);
+        free(client->output);
+        free(client);
+    }
+}
+
+static void json_client_close(json_client_st * const client)
+{
+    if (client->closed)
+    {
+        goto done;
+    }
+
+    client->closed = true;
+    list_del(&client->list);
+    num_json_clients--;
+    uloop_fd_delete(&client->fd);
+    close(client->fd.fd);
+    json_client_put(client);
+
+done:
+    return;
+}
+
+/* Returns the number of bytes written, which is 0 if the socket is 
+ * full, or -1 if the connection has failed. 
+ */
+static ssize_t json_client_write(json_client_st * const client, char const * const data, size_t const length)
+{
+    ssize_t bytes_written = 
+        TEMP_FAILURE_RETRY(send(client->fd.fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT));
+
+    if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        bytes_written = 0;
+    }
+
+    return bytes_written;
+}
+
+static void json_client_flush(json_client_st * const client)
+{
+    ssize_t const bytes_written = json_client_write(client, client->output, client->output_length);
+
+    if (bytes_written < 0)
+    {
+        json_client_close(client);
+        goto done;
+    }
+
+    client->output_length -= bytes_written;
+    memmove(client->output, client->output + bytes_written, client->output_length);
+
+    if (client->output_length == 0)
+    {
+        uloop_fd_add(&client->fd, ULOOP_READ);
+    }
+
+done:
+    return;
+}
+
+static void json_client_send(json_client_st * const client, char const * const data, size_t const length)
+{
+    ssize_t bytes_written = 0;
+    char * output;
+
+    /* Anything already waiting must go first. */
+    if (client->output_length == 0)
+    {
+        bytes_written = json_client_write(client, data, length);
+        if (bytes_written < 0)
+        {
+            json_client_close(client);
+            goto done;
+        }
+        if ((size_t)bytes_written == length)
+        {
+            goto done;
+        }
+    }
+
+    if (client->output_length + length - bytes_written > JSON_SERVER_MAX_OUTPUT_BYTES)
+    {
+        DPRINTF("\r\nJSON client isn't reading its responses. Closing the connection\n");
+        json_client_close(client);
+        goto done;
+    }
+
+    output = realloc(client->output, client->output_length + length - bytes_written);
+    if (output == NULL)
+    {
+        json_client_close(client);
+        goto done;
+    }
+    memcpy(output + client->output_length, data + bytes_written, length - bytes_written);
+    client->output = output;
+    client->output_length += length - bytes_written;
+
+    uloop_fd_add(&client->fd, ULOOP_READ | ULOOP_WRITE);
+
+done:
+    return;
+}
+
+static void json_client_response(void * const response_context, json_object * const response)
+{
+    json_client_st * const client = response_context;
+
+    if (response != NULL && !client->closed)
+    {
+        char const * const response_string = 
+            json_object_to_json_string_ext(response, JSON_C_TO_STRING_PLAIN);
+
+        /* One response per line, so that simple clients can read 
+         * them with a line reader. 
+         */
+        json_client_send(client, response_string, strlen(response_string));
+        if (!client->closed)
+        {
+            json_client_send(client, "\n", 1);
+        }
+    }
+
+    json_client_put(client);
+}
+
+static void json_client_process_request(json_client_st * const client, json_object * const request)
+{
+    char const * const module_name = message_module_name(request);
+    json_module_st const * const json_module = json_module_find(module_name);
+
+    /* The reference is released once the request has been 
+     * answered, which may be before this returns. 
+     */
+    client->references++;
+
+    if (json_module == NULL)
+    {
+        DPRINTF("\r\nJSON request for unknown module %s\n", 
+                (module_name != NULL) ? module_name : "(default)");
+        message_respond_error(request, MESSAGE_ERROR_UNKNOWN_MODULE, json_client_response, client);
+        goto done;
+    }
+
+    process_json_message(request, 
+                         json_module->handlers, 
+                         json_module->user_info, 
+                         json_client_response, 
+                         client);
+
+done:
+    return;
+}
+
+static void json_client_binary_response(void * const response_context, 
+                                        binary_response_st const * const response)
+{
+    json_client_st * const client = response_context;
+
+    if (!client->closed)
+    {
+        json_client_send(client, (char const *)response, sizeof *response);
+    }
+
+    json_client_put(client);
+}
+
+static void json_client_process_binary_request(json_client_st * const client, 
+                                               binary_request_st const * const request)
+{
+    json_module_st const * const json_module = json_module_at(request->module);
+
+    client->references++;
+
+    if (json_module == NULL)
+    {
+        binary_respond_status(request, BINARY_STATUS_UNKNOWN_MODULE, json_client_binary_response, client);
+        goto done;
+    }
+
+    process_binary_request(request, 
+                           json_module->handlers, 
+                           json_module->user_info, 
+                           json_client_binary_response, 
+                           client);
+
+done:
+    return;
+}
+
+static void json_client_read_binary(json_client_st * const client)
+{
+    ssize_t bytes_read;
+    size_t offset;
+
+    bytes_read = TEMP_FAILURE_RETRY(read(client->fd.fd, 
+                                         &client->binary_input[client->binary_input_length], 
+                                         sizeof client->binary_input - client->binary_input_length));
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        goto done;
+    }
+    if (bytes_read <= 0)
+    {
+        json_client_close(client);
+        goto done;
+    }
+    client->binary_input_length += bytes_read;
+
+    for (offset = 0; 
+         !client->closed && client->binary_input_length - offset >= sizeof(binary_request_st); 
+         offset += sizeof(binary_request_st))
+    {
+        binary_request_st request;
+
+        memcpy(&request, &client->binary_input[offset], sizeof request);
+        if (request.magic != BINARY_REQUEST_MAGIC)
+        {
+            /* The client and the server no longer agree on where the 
+             * requests start. 
+             */
+            DPRINTF("\r\ninvalid binary request from client. Closing the connection\n");
+            json_client_close(client);
+            goto done;
+        }
+        json_client_process_binary_request(client, &request);
+    }
+
+    client->binary_input_length -= offset;
+    memmove(client->binary_input, &client->binary_input[offset], client->binary_input_length);
+
+done:
+    return;
+}
+
+static bool json_client_detect_protocol(json_client_st * const client)
+{
+    bool detected_protocol;
+    uint8_t first_byte;
+    ssize_t const bytes_read = 
+        TEMP_FAILURE_RETRY(recv(client->fd.fd, &first_byte, sizeof first_byte, MSG_PEEK));
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        detected_protocol = false;
+        goto done;
+    }
+    if (bytes_read <= 0)
+    {
+        json_client_close(client);
+        detected_protocol = false;
+        goto done;
+    }
+
+    /* A JSON request can't start with the binary magic byte. */
+    client->protocol = 
+        (first_byte == BINARY_REQUEST_MAGIC) ? CLIENT_PROTOCOL_BINARY : CLIENT_PROTOCOL_JSON;
+    detected_protocol = true;
+
+done:
+    return detected_protocol;
+}
+
+static void json_client_read_json(json_client_st * const client)
+{
+    ssize_t bytes_read;
+    json_object * request;
+    bool failed = false;
+
+    bytes_read = json_reader_fill(client->reader, client->fd.fd);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        goto done;
+    }
+    if (bytes_read <= 0)
+    {
+        json_client_close(client);
+        goto done;
+    }
+
+    while (!client->closed && (request = json_reader_next(client->reader, &failed)) != NULL)
+    {
+        json_client_process_request(client, request);
+        json_object_put(request);
+    }
+
+    if (!client->closed && failed)
+    {
+        DPRINTF("\r\ninvalid JSON from client. Closing the connection\n");
+        json_client_close(client);
+        goto done;
+    }
+
+done:
+    return;
+}
+
+static void json_client_read(json_client_st * const client)
+{
+    if (client->protocol == CLIENT_PROTOCOL_UNKNOWN && !json_client_detect_protocol(client))
+    {
+        goto done;
+    }
+
+    /* Only one read is done each time, so that a busy client 
+     * doesn't hold up the others. Anything left is read next time 
+     * around the loop. 
+     */
+    if (client->protocol == CLIENT_PROTOCOL_BINARY)
+    {
+        json_client_read_binary(client);
+    }
+    else
+    {
+        json_client_read_json(client);
+    }
+
+done:
+    return;
+}
+
+static void json_client_fd_handler(struct uloop_fd * const fd, unsigned int const events)
+{
+    json_client_st * const client = container_of(fd, json_client_st, fd);
+
+    /* Hold on to the client, as it may be closed while it is being 
+     * serviced. 
+     */
+    client->references++;
+
+    if ((events & ULOOP_WRITE) != 0)
+    {
+        json_client_flush(client);
+    }
+
+    if (!client->closed && (events & ULOOP_READ) != 0)
+    {
+        json_client_read(client);
+    }
+
+    json_client_put(client);
+}
+
+static void json_client_add(int const client_fd)
+{
+    bool added_client;
+    json_client_st * const client = calloc(1, sizeof *client);
+
+    if (client == NULL)
+    {
+        added_client = false;
+        goto done;
+    }
+
+    if (num_json_clients >= JSON_SERVER_MAX_CLIENTS)
+    {
+        DPRINTF("\r\ntoo many JSON clients. Closing the connection\n");
+        added_client = false;
+        goto done;
+    }
+
+    if (!set_nonblocking(client_fd))
+    {
+        added_client = false;
+        goto done;
+    }
+
+    client->reader = json_reader_create();
+    if (client->reader == NULL)
+    {
+        added_client = false;
+        goto done;
+    }
+
+    client->fd.fd = client_fd;
+    client->fd.cb = json_client_fd_handler;
+    if (uloop_fd_add(&client->fd, ULOOP_READ) < 0)
+    {
+        added_client = false;
+        goto done;
+    }
+
+    list_add_tail(&client->list, &json_clients);
+    num_json_clients++;
+    client->references = 1;
+
+    added_client = true;
+
+done:
+    if (!added_client)
+    {
+        if (client != NULL)
+        {
+            json_reader_free(client->reader);
+            free(client);
+        }
+        close(client_fd);
+    }
+}
+
+static void json_server_accept_handler(struct uloop_fd * const fd, unsigned int const events)
+{
+    int client_fd;
+
+    /* Accept every connection that is waiting. */
+    while ((client_fd = accept(fd->fd, NULL, NULL)) >= 0)
+    {
+        json_client_add(client_fd);
+    }
+}
+
+bool json_server_add_module(char const * const module_name,
+                            message_handler_st const * const handlers,
+                            void * const user_info)
+{
+    bool added_module;
+    json_module_st * const json_module = calloc(1, sizeof *json_module);
+
+    if (json_module == NULL)
+    {
+        added_module = false;
+        goto done;
+    }
+
+    if (module_name != NULL)
+    {
+        json_module->name = strdup(module_name);
+        if (json_module->name == NULL)
+        {
+            free(json_module);
+            added_module = false;
+            goto done;
+        }
+    }
+    json_module->handlers = handlers;
+    json_module->user_info = user_info;
+
+    list_add_tail(&json_module->list, &json_modules);
+
+    added_module = true;
+
+done:
+    return added_module;
+}
+
+bool json_server_initialise(char const * const socket_name)
+{
+    bool initialised;
+
+    listen_socket_name = strdup(socket_name);
+    if (listen_socket_name == NULL)
+    {
+        initialised = false;
+        goto done;
+    }
+
+    listen_fd.fd = listen_on_unix_socket(socket_name, false);
+    if (listen_fd.fd < 0)
+    {
+        initialised = false;
+        goto done;
+    }
+
+    if (!set_nonblocking(listen_fd.fd))
+    {
+        initialised = false;
+        goto done;
+    }
+
+    listen_fd.cb = json_server_accept_handler;
+    if (uloop_fd_add(&listen_fd, ULOOP_READ) < 0)
+    {
+        initialised = false;
+        goto done;
+    }
+
+    initialised = true;
+
+done:
+    if (!initialised)
+    {
+        json_server_done();
+    }
+
+    return initialised;
+}
+
+void json_server_done(void)
+{
+    json_client_st * client;
+    json_client_st * tmp_client;
+    json_module_st * json_module;
+    json_module_st * tmp_module;
+
+    /* Clients with requests still in progress are freed once the 
+     * requests have completed. 
+     */
+    list_for_each_entry_safe(client, tmp_client, &json_clients, list)
+    {
+        json_client_close(client);
+    }
+
+    list_for_each_entry_safe(json_module, tmp_module, &json_modules, list)
+    {
+        list_del(&json_module->list);
+        free(json_module->name);
+        free(json_module);
+    }
+
+    if (listen_fd.fd >= 0)
+    {
+        uloop_fd_delete(&listen_fd);
+        close_unix_socket(listen_fd.fd);
+        listen_fd.fd = -1;
+        unlink(listen_socket_name);
+    }
+    free(listen_socket_name);
+    listen_socket_name = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef __JSON_SERVER_H__
+#define __JSON_SERVER_H__
+
+#include "message_handler.h"
+
+#include <stdbool.h>
+
+/* Serves JSON requests on a unix socket. Any number of clients may 
+ * be connected, and each may send any number of requests on its 
+ * connection. A client whose first byte is BINARY_REQUEST_MAGIC 
+ * sends binary requests (see binary_message.h) instead. 
+ */
+bool json_server_initialise(char const * const socket_name);
+
+/* JSON requests name the module they are for with a "module" 
+ * parameter. Requests without one are for the first module added. 
+ * Binary requests give the module's position in the order the 
+ * modules were added. The handlers are called with user_info. 
+ */
+bool json_server_add_module(char const * const module_name,
+                            message_handler_st const * const handlers,
+                            void * const user_info);
+
+void json_server_done(void);
+
+#endif /* __JSON_SERVER_H__ */
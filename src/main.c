@@ -1,10 +1,17 @@
 #include "relay_module.h"
 #include "relay_states.h"
+#include "relay_controller.h"
+#include "gpio_lines.h"
+#include "adc_sampler.h"
+#include "config.h"
 #include "daemonize.h"
 #include "debug.h"
 #include "ubus.h"
 #include "ubus_server.h"
-#include "message.h"
+#include "json_server.h"
+#include "state_snapshot.h"
+
+#include <libubox/uloop.h>
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -22,151 +29,174 @@
 #define DEFAULT_USERNAME "admin"
 #define DEFAULT_PASSWORD "admin"
 
-#define TELNET_PORT 23
-
-/* The socket to the relay controller module will be closed once
- * the incoming message socket has been idel for this period of 
- * time.
+/* By default the session with each module is kept open. It can 
+ * instead be closed, or the module checked, once the session has 
+ * been idle for this period of time. 
  */
-#define MESSAGE_INACTIVITY_TIMEOUT_SECONDS 20
+#define DEFAULT_SESSION_MODE RELAY_MODULE_SESSION_PERSISTENT
+#define DEFAULT_IDLE_TIMEOUT_MILLISECS 20000
 
 /* The relay module is usually only updated when the relay 
- * states need to change. They will also be updated if there 
- * has been no update for this period of time. This will 
- * ensure that if the relay module has been reset for some 
+ * states need to change. The states are also read back from the 
+ * module this often, and written again if they don't match. This 
+ * will ensure that if the relay module has been reset for some 
  * reason (e.g. power outage) that it will be updated again 
  * within a failry short amount of time. 
  */
-#define MAXIMUM_SECONDS_BETWEEN_RELAY_MODULE_UPDATES 120
+#define DEFAULT_RECONCILE_INTERVAL_SECONDS 120
 
-typedef struct message_handler_info_st
-{
-    relay_module_info_st const * relay_module_info;
-    int * relay_fd;
-} message_handler_info_st;
+/* Requests to change the relay states that arrive within this 
+ * many milliseconds of each other are merged and written to the 
+ * module with a single writeall command. 
+ */
+#define DEFAULT_COALESCE_WINDOW_MILLISECS 10
 
-typedef struct relay_state_ctx_st
-{
-    relay_states_st * current_states;
-    time_t last_written;
-} relay_state_ctx_st;
+/* Requests for the relay states are answered from the daemon's 
+ * copy of the states unless it is older than this, in which case 
+ * the states are read from the module. 
+ */
+#define DEFAULT_MAXIMUM_STATE_AGE_MILLISECS 2000
+
+/* The time allowed to connect and log in to a module, and for a 
+ * module to respond to each command. The session is restarted if 
+ * a module takes longer than this. 
+ */
+#define DEFAULT_CONNECT_TIMEOUT_MILLISECS 5000
+#define DEFAULT_LOGIN_TIMEOUT_MILLISECS 15000
+#define DEFAULT_COMMAND_TIMEOUT_MILLISECS 5000
+
+/* The number of commands that may be sent to a module before 
+ * waiting for the response to the first of them. 
+ */
+#define DEFAULT_PIPELINE_DEPTH 4
 
-static void set_state_handler(void * const user_info, relay_states_st * const desired_relay_states);
+/* Modules are assumed to have 8 relays unless told otherwise. */
+#define DEFAULT_NUM_RELAYS 8
 
-static relay_state_ctx_st relay_state_ctx;
+/* Any GPIO lines used as inputs are read from the module this 
+ * often, so that requests for them don't have to wait for it. 
+ */
+#define DEFAULT_GPIO_POLL_INTERVAL_MILLISECS 1000
 
-static message_handler_st const message_handlers =
+static void relay_module_info_init(relay_module_info_st * const relay_module_info,
+                                   char const * const module_address,
+                                   uint16_t const module_port,
+                                   char const * const username,
+                                   char const * const password)
 {
-    .set_state_handler = set_state_handler
-};
+    relay_module_info->address = module_address;
+    relay_module_info->port = module_port;
+    relay_module_info->username = username;
+    relay_module_info->password = password;
+}
 
-static int relay_fd = -1;
-static message_handler_info_st message_handler_info;
+static void usage(char const * const program_name)
+{
+    fprintf(stdout, "Usage: %s [options] <GPIO module address> <username> <password>\n", program_name);
+    fprintf(stdout, "       %s [options] -c <configuration file>\n", program_name);
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -c %-21s %s\n", "configuration file", "Read the modules to control from a file");
+    fprintf(stdout, "  -d %-21s %s\n", "", "Run as a daemon");
+    fprintf(stdout, "  -s %-21s %s\n", "ubus socket", "Ubus socket path");
+    fprintf(stdout, "  -j %-21s %s\n", "socket path", "Also serve JSON and binary requests on a unix socket");
+    fprintf(stdout, "  -S %-21s %s\n", "file", "Publish the module states in a shared file e.g. /run/numato.state");
+    fprintf(stdout, "  -w %-21s %s (default %u)\n", "milliseconds", "Window to merge relay updates in", DEFAULT_COALESCE_WINDOW_MILLISECS);
+    fprintf(stdout, "  -a %-21s %s (default %u)\n", "milliseconds", "Maximum age of cached relay states", DEFAULT_MAXIMUM_STATE_AGE_MILLISECS);
+    fprintf(stdout, "  -r %-21s %s (default %u, 0 to disable)\n", "seconds", "Interval to check the module states", DEFAULT_RECONCILE_INTERVAL_SECONDS);
+    fprintf(stdout, "  -m %-21s %s\n", "session mode", "persistent (default), keepalive or idle_close");
+    fprintf(stdout, "  -i %-21s %s (default %u)\n", "milliseconds", "Time before an idle session is checked or closed", DEFAULT_IDLE_TIMEOUT_MILLISECS);
+    fprintf(stdout, "  -o %-21s %s (default %u)\n", "milliseconds", "Time allowed to connect to a module", DEFAULT_CONNECT_TIMEOUT_MILLISECS);
+    fprintf(stdout, "  -l %-21s %s (default %u)\n", "milliseconds", "Time allowed to log in to a module", DEFAULT_LOGIN_TIMEOUT_MILLISECS);
+    fprintf(stdout, "  -t %-21s %s (default %u)\n", "milliseconds", "Time allowed for each module command", DEFAULT_COMMAND_TIMEOUT_MILLISECS);
+    fprintf(stdout, "  -v %-21s %s\n", "", "Read the relay states back after writing them");
+    fprintf(stdout, "  -p %-21s %s (default %u, 1 to disable)\n", "depth", "Commands to send ahead of the responses", DEFAULT_PIPELINE_DEPTH);
+    fprintf(stdout, "  -n %-21s %s (default %u)\n", "relays", "Relays on the module: 8, 16, 32 or 64", DEFAULT_NUM_RELAYS);
+    fprintf(stdout, "  -I %-21s %s\n", "GPIO numbers", "GPIO lines to use as inputs e.g. 0,1,2");
+    fprintf(stdout, "  -O %-21s %s\n", "GPIO numbers", "GPIO lines to use as outputs");
+    fprintf(stdout, "  -g %-21s %s (default %u, 0 to disable)\n", "milliseconds", "Interval to read the GPIO inputs", DEFAULT_GPIO_POLL_INTERVAL_MILLISECS);
+    fprintf(stdout, "  -A %-21s %s (default interval %u)\n", "channel[:ms[:level]]", "ADC inputs to sample, and thresholds", ADC_DEFAULT_SAMPLE_INTERVAL_MILLISECS);
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Apart from -c, -d, -s, -j and -S, the options are the defaults for modules in the configuration file.\n");
+}
 
-static bool need_to_update_module(relay_state_ctx_st const * const relay_state_ctx,
-                                  unsigned int const writeall_bitmask)
+static void free_relay_controllers(relay_controller_st * * const relay_controllers, size_t const num_controllers)
 {
-    bool need_to_write_states;
+    size_t index;
 
-    if (relay_state_ctx->current_states == NULL)
-    {
-        /* True if the relay states haven't been updated yet. */
-        need_to_write_states = true;
-    }
-    else if (writeall_bitmask != relay_states_get_states_bitmask(relay_state_ctx->current_states))
-    {
-        need_to_write_states = true;
-    }
-    else if (writeall_bitmask != 0
-             && difftime(time(NULL), relay_state_ctx->last_written) >= MAXIMUM_SECONDS_BETWEEN_RELAY_MODULE_UPDATES)
+    if (relay_controllers == NULL)
     {
-        /* This will ensure that if the relay module restarts and we 
-         * want some relays to be on that we'll always turn them on 
-         * again within a few minutes, assuming we can communicate 
-         * with the module. 
-         */
-        need_to_write_states = true;
+        goto done;
     }
-    else
+
+    for (index = 0; index < num_controllers; index++)
     {
-        need_to_write_states = false;
+        relay_controller_free(relay_controllers[index]);
     }
+    free(relay_controllers);
 
-    return need_to_write_states;
+done:
+    return;
 }
 
-static void relay_states_update_module(relay_states_st const * const relay_states,
-                                       relay_module_info_st const * const relay_module_info,
-                                       int * const relay_fd)
+static relay_controller_st * * create_relay_controllers(config_st const * const config)
 {
-    unsigned int writeall_bitmask;
-    relay_states_st * desired_states;
+    bool created_controllers;
+    relay_controller_st * * relay_controllers;
+    size_t index;
 
-    /* Overlay the desired states with the current states. The new 
-     * request may not want to change the states of all the 
-     * relays. 
-     */
-    desired_states = relay_states_combine(relay_state_ctx.current_states, relay_states);
-    if (desired_states == NULL)
+    relay_controllers = calloc(config->num_modules, sizeof *relay_controllers);
+    if (relay_controllers == NULL)
     {
+        created_controllers = false;
         goto done;
     }
-    writeall_bitmask = relay_states_get_states_bitmask(desired_states);
 
-    if (need_to_update_module(&relay_state_ctx, writeall_bitmask))
+    for (index = 0; index < config->num_modules; index++)
     {
-        if (!update_relay_module(writeall_bitmask, relay_module_info, relay_fd))
+        module_config_st const * const module = &config->modules[index];
+        char const * const name = 
+            (module->name != NULL) ? module->name : module->relay_module_info.address;
+
+        relay_controllers[index] = relay_controller_create(name, 
+                                                           &module->relay_module_info, 
+                                                           &module->settings);
+        if (relay_controllers[index] == NULL)
         {
+            DPRINTF("\r\nfailed to create relay controller for %s\n", name);
+            created_controllers = false;
             goto done;
         }
-        /* Update the current states after the new states have been 
-         * successfully written to the module. 
-         */
-        relay_states_free(relay_state_ctx.current_states);
-        relay_state_ctx.current_states = desired_states;
-        desired_states = NULL;
-
-        /* Save the time when the states were last written. This is used 
-         * to periodically check if the states need to be forcibly 
-         * updated even if no desired states are changed. 
-         */
-        relay_state_ctx.last_written = time(NULL);
-    }
 
-done:
-    relay_states_free(desired_states);
+        if (!ubus_server_add_module(module->name, 
+                                    relay_controller_message_handlers(), 
+                                    relay_controllers[index]))
+        {
+            DPRINTF("\r\nfailed to publish relay controller for %s\n", name);
+            created_controllers = false;
+            goto done;
+        }
 
-    return;
-}
+        if (!json_server_add_module(module->name, 
+                                    relay_controller_message_handlers(), 
+                                    relay_controllers[index]))
+        {
+            DPRINTF("\r\nfailed to add relay controller for %s to the JSON server\n", name);
+            created_controllers = false;
+            goto done;
+        }
+    }
 
-static void set_state_handler(void * const user_info, relay_states_st * const desired_relay_states)
-{
-    message_handler_info_st * info = user_info;
+    created_controllers = true;
 
-    relay_states_update_module(desired_relay_states, 
-                               info->relay_module_info, 
-                               info->relay_fd);
-}
-
-static void relay_module_info_init(relay_module_info_st * const relay_module_info,
-                                   char const * const module_address,
-                                   uint16_t const module_port,
-                                   char const * const username,
-                                   char const * const password)
-{
-    relay_module_info->address = module_address;
-    relay_module_info->port = module_port;
-    relay_module_info->username = username;
-    relay_module_info->password = password;
-}
+done:
+    if (!created_controllers)
+    {
+        free_relay_controllers(relay_controllers, config->num_modules);
+        relay_controllers = NULL;
+    }
 
-static void usage(char const * const program_name)
-{
-    fprintf(stdout, "Usage: %s [options] <GPIO module address> <username> <password>\n", program_name);
-    fprintf(stdout, "\n");
-    fprintf(stdout, "Options:\n");
-    fprintf(stdout, "  -d %-21s %s\n", "", "Run as a daemon");
-    fprintf(stdout, "  -s %-21s %s\n", "ubus socket", "Ubus socket path");
+    return relay_controllers;
 }
 
 int main(int argc, char * * argv)
@@ -179,16 +209,122 @@ int main(int argc, char * * argv)
     unsigned int args_remaining;
     int option;
     char const * listening_socket_name = NULL;
+    char const * json_socket_name = NULL;
+    char const * snapshot_filename = NULL;
+    char const * config_filename = NULL;
+    relay_controller_settings_st settings =
+    {
+        .coalesce_window_millisecs = DEFAULT_COALESCE_WINDOW_MILLISECS,
+        .maximum_state_age_millisecs = DEFAULT_MAXIMUM_STATE_AGE_MILLISECS,
+        .reconcile_interval_seconds = DEFAULT_RECONCILE_INTERVAL_SECONDS,
+        .module_settings =
+        {
+            .session_mode = DEFAULT_SESSION_MODE,
+            .idle_millisecs = DEFAULT_IDLE_TIMEOUT_MILLISECS,
+            .connect_millisecs = DEFAULT_CONNECT_TIMEOUT_MILLISECS,
+            .login_millisecs = DEFAULT_LOGIN_TIMEOUT_MILLISECS,
+            .command_millisecs = DEFAULT_COMMAND_TIMEOUT_MILLISECS,
+            .pipeline_depth = DEFAULT_PIPELINE_DEPTH,
+            .num_relays = DEFAULT_NUM_RELAYS
+        },
+        .gpio_settings =
+        {
+            .poll_interval_millisecs = DEFAULT_GPIO_POLL_INTERVAL_MILLISECS
+        }
+    };
+    config_st * config = NULL;
+    relay_controller_st * * relay_controllers = NULL;
+    state_snapshot_st * state_snapshot = NULL;
 
-    while ((option = getopt(argc, argv, "s:?d")) != -1)
+    while ((option = getopt(argc, argv, "c:s:j:S:w:a:r:m:i:o:l:t:p:n:I:O:g:A:v?d")) != -1)
     {
         switch (option)
         {
+            case 'c':
+                config_filename = optarg;
+                break;
             case 'd':
                 daemonise = true;
                 break;
             case 's':
-                listening_socket_name = argv[optind];
+                listening_socket_name = optarg;
+                break;
+            case 'j':
+                json_socket_name = optarg;
+                break;
+            case 'S':
+                snapshot_filename = optarg;
+                break;
+            case 'w':
+                settings.coalesce_window_millisecs = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                settings.maximum_state_age_millisecs = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                settings.reconcile_interval_seconds = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                if (!relay_module_session_mode_from_string(optarg, &settings.module_settings.session_mode))
+                {
+                    fprintf(stderr, "Unknown session mode: %s\n", optarg);
+                    exit_code = EXIT_FAILURE;
+                    goto done;
+                }
+                break;
+            case 'i':
+                settings.module_settings.idle_millisecs = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                settings.module_settings.connect_millisecs = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                settings.module_settings.login_millisecs = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                settings.module_settings.command_millisecs = strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                settings.verify_writes = true;
+                break;
+            case 'p':
+                settings.module_settings.pipeline_depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                settings.module_settings.num_relays = strtoul(optarg, NULL, 10);
+                if (numato_model_find(settings.module_settings.num_relays) == NULL)
+                {
+                    fprintf(stderr, "No module has %s relays\n", optarg);
+                    exit_code = EXIT_FAILURE;
+                    goto done;
+                }
+                break;
+            case 'I':
+                if (!gpio_lines_from_string(optarg, &settings.gpio_settings.inputs_bitmask))
+                {
+                    fprintf(stderr, "Invalid GPIO lines: %s\n", optarg);
+                    exit_code = EXIT_FAILURE;
+                    goto done;
+                }
+                break;
+            case 'O':
+                if (!gpio_lines_from_string(optarg, &settings.gpio_settings.outputs_bitmask))
+                {
+                    fprintf(stderr, "Invalid GPIO lines: %s\n", optarg);
+                    exit_code = EXIT_FAILURE;
+                    goto done;
+                }
+                break;
+            case 'g':
+                settings.gpio_settings.poll_interval_millisecs = strtoul(optarg, NULL, 10);
+                break;
+            case 'A':
+                if (!adc_sampler_channels_from_string(optarg, &settings.adc_settings))
+                {
+                    fprintf(stderr, "Invalid ADC channels: %s\n", optarg);
+                    exit_code = EXIT_FAILURE;
+                    goto done;
+                }
                 break;
             case '?':
                 usage(basename(argv[0]));
@@ -197,21 +333,36 @@ int main(int argc, char * * argv)
         }
     }
 
-    args_remaining = argc - optind;
-    if (args_remaining < min_args)
+    if (config_filename != NULL)
+    {
+        config = config_load(config_filename, &settings);
+    }
+    else
+    {
+        args_remaining = argc - optind;
+        if (args_remaining < min_args)
+        {
+            usage(basename(argv[0]));
+            exit_code = EXIT_FAILURE;
+            goto done;
+        }
+
+        relay_module_info_init(&relay_module_info,
+                               argv[optind], 
+                               TELNET_PORT,
+                               argv[optind + 1],
+                               argv[optind + 2]
+                               );
+        config = config_create_single(&relay_module_info, &settings);
+    }
+
+    if (config == NULL)
     {
-        usage(basename(argv[0]));
+        fprintf(stderr, "Failed to load the module configuration. Exiting\n");
         exit_code = EXIT_FAILURE;
         goto done;
     }
 
-    relay_module_info_init(&relay_module_info,
-                           argv[optind], 
-                           TELNET_PORT,
-                           argv[optind + 1],
-                           argv[optind + 2]
-                           );
-
     if (daemonise)
     {
         daemonise_result = daemonize(NULL, NULL, NULL);
@@ -229,6 +380,8 @@ int main(int argc, char * * argv)
         }
     }
 
+    uloop_init();
+
     struct ubus_context * const ubus_ctx = ubus_initialise(listening_socket_name);
 
     if (ubus_ctx == NULL)
@@ -238,14 +391,7 @@ int main(int argc, char * * argv)
         goto done;
     }
 
-    message_handler_info.relay_fd = &relay_fd;
-    message_handler_info.relay_module_info = &relay_module_info;
-
-    bool const ubus_server_initialised = 
-        ubus_server_initialise(
-            ubus_ctx, 
-            &message_handlers, 
-            &message_handler_info);
+    bool const ubus_server_initialised = ubus_server_initialise(ubus_ctx);
 
     if (!ubus_server_initialised)
     {
@@ -254,15 +400,68 @@ int main(int argc, char * * argv)
         goto done;
     }
 
+    /* Scripts that change the relays often can keep a connection 
+     * open to this socket, rather than running ubus for each change. 
+     */
+    if (json_socket_name != NULL && !json_server_initialise(json_socket_name))
+    {
+        DPRINTF("\r\nfailed to listen for JSON requests on %s\n", json_socket_name);
+        exit_code = EXIT_FAILURE;
+        goto done;
+    }
+
+    /* Each module has its own session and states, and is serviced 
+     * independently of the others. 
+     */
+    relay_controllers = create_relay_controllers(config);
+    if (relay_controllers == NULL)
+    {
+        exit_code = EXIT_FAILURE;
+        goto done;
+    }
+
+    /* Processes that only need to read the states can map this file 
+     * rather than asking over ubus. 
+     */
+    if (snapshot_filename != NULL)
+    {
+        size_t index;
+
+        state_snapshot = state_snapshot_create(snapshot_filename, config->num_modules);
+        if (state_snapshot == NULL)
+        {
+            DPRINTF("\r\nfailed to create the state snapshot %s\n", snapshot_filename);
+            exit_code = EXIT_FAILURE;
+            goto done;
+        }
+        for (index = 0; index < config->num_modules; index++)
+        {
+            relay_controller_publish_snapshot(relay_controllers[index], 
+                                              state_snapshot_module(state_snapshot, index));
+        }
+    }
+
     uloop_run();
 
     uloop_done();
 
-    ubus_done();
+    /* Freeing the controllers fails any requests still waiting on 
+     * the modules, and the ubus replies to them need the context, so 
+     * it is freed last. The servers stop listening for state changes 
+     * before the controllers go. 
+     */
     ubus_server_done(); 
+    json_server_done();
+
+    free_relay_controllers(relay_controllers, config->num_modules);
+    state_snapshot_free(state_snapshot);
+
+    ubus_done();
 
     exit_code = EXIT_SUCCESS;
 
 done:
+    config_free(config);
+
     exit(exit_code);
 }
@@ -2,63 +2,139 @@
 #include "relay_states.h"
 #include "message_handler.h"
 
-#include <get_char_with_timeout.h>
-
 #include <json-c/json.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <time.h>
-#include <unistd.h>
-
-#define JSON_MESSAGE_READ_TIMEOUT_SECONDS 5
+#include <stdlib.h>
 
 static char const relay_params_array_name[] = "relays";
 static char const relay_state_field_name[] = "state";
 static char const relay_id_field_name[] = "id";
+static char const module_field_name[] = "module";
 static char const relay_state_on_string[] = "on";
 static char const relay_state_off_string[] = "off";
 static char const relay_method_set_state_string[] = "set state"; 
-
-static json_object * read_json_from_stream(int const fd, unsigned int const read_timeout_seconds)
+static char const jsonrpc_field_name[] = "jsonrpc";
+static char const jsonrpc_version_string[] = "2.0";
+static char const request_id_field_name[] = "id";
+static char const result_field_name[] = "result";
+static char const error_field_name[] = "error";
+static char const error_code_field_name[] = "code";
+static char const error_message_field_name[] = "message";
+static char const error_data_field_name[] = "data";
+static char const invalid_zone_field_name[] = "zone";
+
+typedef struct message_error_info_st
 {
-    struct json_tokener * tok;
-    json_object * obj = NULL;
-    enum json_tokener_error error = json_tokener_continue;
-    int get_char_result;
+    int code;
+    char const * message;
+} message_error_info_st;
+
+/* The standard JSON-RPC codes where there is one. The others are 
+ * from the range left for servers to define. 
+ */
+static message_error_info_st const message_errors[] =
+{
+    [MESSAGE_ERROR_INVALID_REQUEST] = { -32600, "Invalid request" },
+    [MESSAGE_ERROR_METHOD_NOT_FOUND] = { -32601, "Method not found" },
+    [MESSAGE_ERROR_INVALID_PARAMS] = { -32602, "Invalid params" },
+    [MESSAGE_ERROR_INTERNAL] = { -32603, "Internal error" },
+    [MESSAGE_ERROR_WRITE_FAILED] = { -32000, "Failed to write the relay states" },
+    [MESSAGE_ERROR_UNKNOWN_MODULE] = { -32001, "Unknown module" }
+};
+
+/* Responses to set state requests are deferred until the module has 
+ * accepted (or failed to accept) the new relay states. 
+ */
+typedef struct deferred_response_st
+{
+    json_object * request_id;
+    message_response_fn response_cb;
+    void * response_context;
+} deferred_response_st;
 
-    tok = json_tokener_new();
+static json_object * get_request_id(json_object * const message)
+{
+    json_object * request_id;
 
-    do
+    /* A request without an id (or with a null one) doesn't want a 
+     * response. 
+     */
+    if (!json_object_object_get_ex(message, request_id_field_name, &request_id))
     {
-        char buf[2];
+        request_id = NULL;
+    }
 
-        get_char_result = get_char_with_timeout(fd, read_timeout_seconds, &buf[0]);
+    return request_id;
+}
 
-        if (get_char_result == sizeof buf[0])
-        {
-            buf[1] = '\0';
+/* error_data is optional, and adds to the error's details. */
+static void send_response(json_object * const request_id,
+                          bool const success,
+                          message_error_t const error,
+                          json_object * const error_data,
+                          message_response_fn const response_cb,
+                          void * const response_context)
+{
+    json_object * response = NULL;
 
-            obj = json_tokener_parse_ex(tok, buf, 1);
-            error = tok->err;
-        }
+    if (request_id == NULL)
+    {
+        goto done;
+    }
 
+    response = json_object_new_object();
+    if (response == NULL)
+    {
+        goto done;
     }
-    while (obj == NULL && get_char_result > 0 && error == json_tokener_continue);
+    json_object_object_add(response, jsonrpc_field_name, json_object_new_string(jsonrpc_version_string));
+    json_object_object_add(response, request_id_field_name, json_object_get(request_id));
+
+    if (success)
+    {
+        json_object_object_add(response, result_field_name, json_object_new_boolean(true));
+    }
+    else
+    {
+        json_object * const error_object = json_object_new_object();
 
-    json_tokener_free(tok);
+        if (error_object != NULL)
+        {
+            json_object_object_add(error_object, error_code_field_name, 
+                                   json_object_new_int(message_errors[error].code));
+            json_object_object_add(error_object, error_message_field_name, 
+                                   json_object_new_string(message_errors[error].message));
+            if (error_data != NULL)
+            {
+                json_object_object_add(error_object, error_data_field_name, json_object_get(error_data));
+            }
+        }
+        json_object_object_add(response, error_field_name, error_object);
+    }
 
-    return obj;
+done:
+    response_cb(response_context, response);
+    json_object_put(response);
 }
 
-static bool parse_zone(json_object * const zone, unsigned int * const relay_id, bool * const state)
+/* A zone is rejected unless it names one of the module's relays and 
+ * says whether to turn it on or off. 
+ */
+static bool parse_zone(json_object * const zone, 
+                       size_t const num_relays,
+                       unsigned int * const relay_id, 
+                       bool * const state)
 {
     bool parsed_zone;
     json_object * object;
     char const * state_value;
+    int64_t id;
 
     json_object_object_get_ex(zone, relay_state_field_name, &object);
-    if (object == NULL)
+    if (json_object_get_type(object) != json_type_string)
     {
         parsed_zone = false;
         goto done;
@@ -66,12 +142,18 @@ static bool parse_zone(json_object * const zone, unsigned int * const relay_id,
     state_value = json_object_get_string(object);
 
     json_object_object_get_ex(zone, relay_id_field_name, &object);
-    if (object == NULL)
+    if (json_object_get_type(object) != json_type_int)
     {
         parsed_zone = false;
         goto done;
     }
-    *relay_id = json_object_get_int(object);
+    id = json_object_get_int64(object);
+    if (id < 0 || id >= num_relays)
+    {
+        parsed_zone = false;
+        goto done;
+    }
+    *relay_id = id;
 
     if (strcasecmp(state_value, relay_state_on_string) == 0)
     {
@@ -92,23 +174,33 @@ done:
     return parsed_zone;
 }
 
-static void process_zone(json_object * const zone, relay_states_st * const relay_states)
+static bool process_zone(json_object * const zone, 
+                         size_t const num_relays,
+                         relay_states_st * const relay_states)
 {
+    bool processed_zone;
     bool state;
     unsigned int relay_id;
 
-    if (!parse_zone(zone, &relay_id, &state))
+    if (!parse_zone(zone, num_relays, &relay_id, &state))
     {
+        processed_zone = false;
         goto done;
     }
 
-    relay_states_set_state(relay_states, relay_id, state);
+    processed_zone = relay_states_set_state(relay_states, relay_id, state);
 
 done:
-    return;
+    return processed_zone;
 }
 
-static relay_states_st * get_desired_relay_states_from_message(json_object * const message)
+/* Returns NULL if any of the zones is invalid, so that a request is 
+ * either applied in full or not at all. invalid_zone is set to the 
+ * index of the first invalid zone, or -1 if the fault lies elsewhere. 
+ */
+static relay_states_st * get_desired_relay_states_from_message(json_object * const message,
+                                                               size_t const num_relays,
+                                                               int * const invalid_zone)
 {
     bool relay_states_populated;
     json_object * params;
@@ -117,6 +209,8 @@ static relay_states_st * get_desired_relay_states_from_message(json_object * con
     int index;
     relay_states_st * relay_states = NULL;
 
+    *invalid_zone = -1;
+
     json_object_object_get_ex(message, "params", &params);
     if (params == NULL)
     {
@@ -143,7 +237,12 @@ static relay_states_st * get_desired_relay_states_from_message(json_object * con
     {
         json_object * const zone = json_object_array_get_idx(zones_array, index);
 
-        process_zone(zone, relay_states);
+        if (!process_zone(zone, num_relays, relay_states))
+        {
+            *invalid_zone = index;
+            relay_states_populated = false;
+            goto done;
+        }
     }
 
     relay_states_populated = true;
@@ -158,22 +257,93 @@ done:
     return relay_states;
 }
 
+static void set_state_done(void * const done_context, bool const success)
+{
+    deferred_response_st * const deferred = done_context;
+
+    send_response(deferred->request_id, 
+                  success, 
+                  MESSAGE_ERROR_WRITE_FAILED, 
+                  NULL,
+                  deferred->response_cb, 
+                  deferred->response_context);
+
+    json_object_put(deferred->request_id);
+    free(deferred);
+}
+
+/* Tells the client which zone was rejected, if it was a zone. */
+static void respond_invalid_params(json_object * const message,
+                                   int const invalid_zone,
+                                   message_response_fn const response_cb,
+                                   void * const response_context)
+{
+    json_object * error_data = NULL;
+
+    if (invalid_zone >= 0)
+    {
+        error_data = json_object_new_object();
+        if (error_data != NULL)
+        {
+            json_object_object_add(error_data, invalid_zone_field_name, json_object_new_int(invalid_zone));
+        }
+    }
+
+    send_response(get_request_id(message), 
+                  false, 
+                  MESSAGE_ERROR_INVALID_PARAMS, 
+                  error_data, 
+                  response_cb, 
+                  response_context);
+
+    json_object_put(error_data);
+}
+
 static void process_set_state_message(json_object * const message,
                                       message_handler_st const * const handlers,
-                                      void * const user_info)
+                                      void * const user_info,
+                                      message_response_fn const response_cb,
+                                      void * const response_context)
 {
     relay_states_st * relay_states;
+    deferred_response_st * deferred;
+    int invalid_zone;
+
+    if (handlers->set_state_handler == NULL)
+    {
+        message_respond_error(message, MESSAGE_ERROR_METHOD_NOT_FOUND, response_cb, response_context);
+        relay_states = NULL;
+        goto done;
+    }
+
+    if (handlers->get_relay_count_handler == NULL)
+    {
+        /* Without the relay count, the zones can't be checked. */
+        message_respond_error(message, MESSAGE_ERROR_INTERNAL, response_cb, response_context);
+        relay_states = NULL;
+        goto done;
+    }
 
-    relay_states = get_desired_relay_states_from_message(message);
+    relay_states = get_desired_relay_states_from_message(message, 
+                                                         handlers->get_relay_count_handler(user_info),
+                                                         &invalid_zone);
     if (relay_states == NULL)
     {
+        respond_invalid_params(message, invalid_zone, response_cb, response_context);
         goto done;
     }
 
-    if (handlers->set_state_handler != NULL)
+    deferred = calloc(1, sizeof *deferred);
+    if (deferred == NULL)
     {
-        handlers->set_state_handler(user_info, relay_states);
+        message_respond_error(message, MESSAGE_ERROR_INTERNAL, response_cb, response_context);
+        goto done;
     }
+    deferred->request_id = json_object_get(get_request_id(message));
+    deferred->response_cb = response_cb;
+    deferred->response_context = response_context;
+
+    handlers->set_state_handler(user_info, relay_states, set_state_done, deferred);
 
 done:
     relay_states_free(relay_states);
@@ -181,51 +351,65 @@ done:
     return;
 }
 
-static void process_json_message(json_object * const message,
-                                 int const msg_fd,
-                                 message_handler_st const * const handlers,
-                                 void * const user_info)
+char const * message_module_name(json_object * const message)
 {
-    json_object * json_method;
-    char const * method_string;
-
-    /* msg_fd is passed so that in the future we can write 
-     * responses back to the sender. 
-     */
+    char const * module_name;
+    json_object * params;
+    json_object * module;
 
-    json_object_object_get_ex(message, "method", &json_method);
-    if (json_method == NULL)
+    json_object_object_get_ex(message, "params", &params);
+    if (params == NULL)
     {
+        module_name = NULL;
         goto done;
     }
-    method_string = json_object_get_string(json_method);
 
-    if (strcasecmp(method_string, relay_method_set_state_string) == 0)
+    json_object_object_get_ex(params, module_field_name, &module);
+    if (json_object_get_type(module) != json_type_string)
     {
-        process_set_state_message(message, handlers, user_info);
+        module_name = NULL;
+        goto done;
     }
+    module_name = json_object_get_string(module);
 
 done:
-    return;
+    return module_name;
 }
 
-void process_new_request(int const msg_sock,
-                         message_handler_st const * const handlers,
-                         void * const user_info)
+void message_respond_error(json_object * const message,
+                           message_error_t const error,
+                           message_response_fn const response_cb,
+                           void * const response_context)
 {
-    json_object * request = NULL;
+    send_response(get_request_id(message), false, error, NULL, response_cb, response_context);
+}
 
-    request = read_json_from_stream(msg_sock, JSON_MESSAGE_READ_TIMEOUT_SECONDS);
+void process_json_message(json_object * const message,
+                          message_handler_st const * const handlers,
+                          void * const user_info,
+                          message_response_fn const response_cb,
+                          void * const response_context)
+{
+    json_object * json_method;
+    char const * method_string;
 
-    if (request == NULL)
+    json_object_object_get_ex(message, "method", &json_method);
+    if (json_object_get_type(json_method) != json_type_string)
     {
+        message_respond_error(message, MESSAGE_ERROR_INVALID_REQUEST, response_cb, response_context);
         goto done;
     }
+    method_string = json_object_get_string(json_method);
 
-    process_json_message(request, msg_sock, handlers, user_info);
+    if (strcasecmp(method_string, relay_method_set_state_string) == 0)
+    {
+        process_set_state_message(message, handlers, user_info, response_cb, response_context);
+    }
+    else
+    {
+        message_respond_error(message, MESSAGE_ERROR_METHOD_NOT_FOUND, response_cb, response_context);
+    }
 
 done:
-    json_object_put(request);
+    return;
 }
-
-
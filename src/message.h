@@ -3,8 +3,48 @@
 
 #include "message_handler.h"
 
-void process_new_request(int const msg_sock,
-                         message_handler_st const * const handler,
-                         void * const user_info);
+#include <json-c/json.h>
+
+/* The reasons a request can fail. Each is sent with its JSON-RPC 
+ * error code. 
+ */
+typedef enum message_error_t
+{
+    MESSAGE_ERROR_INVALID_REQUEST,
+    MESSAGE_ERROR_METHOD_NOT_FOUND,
+    MESSAGE_ERROR_INVALID_PARAMS,
+    MESSAGE_ERROR_INTERNAL,
+    MESSAGE_ERROR_WRITE_FAILED, /* The module didn't accept the new relay states. */
+    MESSAGE_ERROR_UNKNOWN_MODULE
+} message_error_t;
+
+/* Called exactly once for each request, when it has completed. 
+ * response is NULL if nothing is to be sent back, as for requests 
+ * without an "id". The response is freed once the call returns. 
+ */
+typedef void (* message_response_fn)(void * const response_context, json_object * const response);
+
+/* Returns the name of the module that a request is for, or NULL if 
+ * the request doesn't name one. The name belongs to the message. 
+ */
+char const * message_module_name(json_object * const message);
+
+/* Requests with an "id" are answered with a JSON-RPC response 
+ * carrying the same id, so a client can send many requests without 
+ * waiting and match up the responses as they complete. A set state 
+ * request with an invalid zone fails as a whole with "Invalid params", 
+ * and the error's data gives the index of the zone. 
+ */
+void process_json_message(json_object * const message,
+                          message_handler_st const * const handlers,
+                          void * const user_info,
+                          message_response_fn const response_cb,
+                          void * const response_context);
+
+/* Fails a request without processing it. */
+void message_respond_error(json_object * const message,
+                           message_error_t const error,
+                           message_response_fn const response_cb,
+                           void * const response_context);
 
 #endif /* __MESSAGE_H__ */
@@ -3,11 +3,134 @@
 
 #include "relay_states.h"
 
-typedef void (* set_state_handler_fn)(void * const user_info, relay_states_st * const desired_relay_states);
+/* Called once the desired relay states have been written to the 
+ * module (or the write has failed). 
+ */
+typedef void (* set_state_done_fn)(void * const done_context, bool const success);
+
+typedef void (* set_state_handler_fn)(void * const user_info,
+                                      relay_states_st * const desired_relay_states,
+                                      set_state_done_fn const done_cb,
+                                      void * const done_context);
+
+/* Called with the current relay states. These may come from the 
+ * daemon's cached copy, or be read from the module. 
+ */
+typedef void (* get_states_done_fn)(void * const done_context,
+                                    bool const success,
+                                    uint64_t const states_bitmask);
+
+typedef void (* get_states_handler_fn)(void * const user_info,
+                                       get_states_done_fn const done_cb,
+                                       void * const done_context);
+
+/* The number of relays on the module. */
+typedef size_t (* get_relay_count_handler_fn)(void * const user_info);
+
+/* Turns all of the relays off, ahead of anything else waiting to 
+ * be sent to the module. 
+ */
+typedef void (* all_off_handler_fn)(void * const user_info,
+                                    set_state_done_fn const done_cb,
+                                    void * const done_context);
+
+/* The module's GPIO lines are numbered separately from the relays, 
+ * with the inputs and the outputs each numbered from 0. 
+ */
+typedef enum gpio_direction_t
+{
+    GPIO_DIRECTION_INPUT,
+    GPIO_DIRECTION_OUTPUT
+} gpio_direction_t;
+
+typedef size_t (* get_gpio_count_handler_fn)(void * const user_info, gpio_direction_t const direction);
+
+/* The states bitmask has bit n set if GPIO input or output n is 
+ * high. 
+ */
+typedef void (* get_gpio_states_handler_fn)(void * const user_info,
+                                            gpio_direction_t const direction,
+                                            get_states_done_fn const done_cb,
+                                            void * const done_context);
+
+typedef void (* set_gpio_output_handler_fn)(void * const user_info,
+                                            unsigned int const output,
+                                            bool const state,
+                                            set_state_done_fn const done_cb,
+                                            void * const done_context);
+
+#define ADC_MAX_CHANNELS 16
+
+/* A summary of the samples taken from an ADC input over a window 
+ * of time ending now. 
+ */
+typedef struct adc_stats_st
+{
+    unsigned int samples; /* The number of samples in the window. */
+    unsigned int minimum;
+    unsigned int maximum;
+    double mean;
+    unsigned int last;
+    unsigned int last_age_millisecs; /* How long ago the last sample was taken. */
+} adc_stats_st;
+
+/* Returns false if the channel isn't being sampled. A window of 0 
+ * covers all of the samples that have been kept. 
+ */
+typedef bool (* get_adc_stats_handler_fn)(void * const user_info,
+                                          unsigned int const channel,
+                                          unsigned int const window_millisecs,
+                                          adc_stats_st * const stats);
+
+/* Describes a change in the states that the daemon keeps track of. */
+typedef enum state_change_type_t
+{
+    STATE_CHANGE_RELAYS, /* The relay states the module has confirmed. */
+    STATE_CHANGE_GPIO_INPUTS,
+    STATE_CHANGE_ADC_THRESHOLD /* An ADC input has crossed its threshold. */
+} state_change_type_t;
+
+typedef struct state_change_st
+{
+    state_change_type_t type;
+    uint64_t states; /* The relay or GPIO input states. */
+    uint64_t changed; /* Bit n is set if relay or input n changed. */
+    unsigned int channel; /* The ADC channel, and the sample that crossed its threshold. */
+    unsigned int value;
+    unsigned int threshold;
+    bool above_threshold;
+} state_change_st;
+
+typedef void (* state_changed_fn)(void * const changed_context, state_change_st const * const change);
+
+/* changed_cb is called for each change from then on. Passing NULL 
+ * stops the calls. 
+ */
+typedef void (* set_state_changed_handler_fn)(void * const user_info,
+                                              state_changed_fn const changed_cb,
+                                              void * const changed_context);
+
+typedef struct relay_status_st
+{
+    unsigned int reconciliations; /* Number of times the module states have been checked. */
+    unsigned int drifts; /* Number of times the module states were found to be wrong. */
+    unsigned int verify_failures; /* Number of writes that the module didn't confirm. */
+} relay_status_st;
+
+typedef void (* get_status_handler_fn)(void * const user_info, relay_status_st * const status);
 
 typedef struct message_handler_st
 {
     set_state_handler_fn set_state_handler;
+    get_states_handler_fn get_states_handler;
+    get_relay_count_handler_fn get_relay_count_handler;
+    get_status_handler_fn get_status_handler;
+    all_off_handler_fn all_off_handler;
+    get_gpio_count_handler_fn get_gpio_count_handler;
+    get_gpio_states_handler_fn get_gpio_states_handler;
+    set_gpio_output_handler_fn set_gpio_output_handler;
+    get_adc_stats_handler_fn get_adc_stats_handler;
+    set_state_changed_handler_fn set_state_changed_handler;
 } message_handler_st;
 
 #endif /* __MESSAGE_HANDLER_H__ */
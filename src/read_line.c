@@ -1,5 +1,4 @@
 #include "read_line.h"
-#include <get_char_with_timeout.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +8,6 @@
 #include <stdbool.h>
 #include <stdio.h>
 
-#define MIN_ALLOC 64
-
 static bool do_telnet_negotiation(int const sock_fd, unsigned char * const buf, unsigned int const buf_len)
 {
     bool negotiation_succeeded;
@@ -40,145 +37,100 @@ done:
     return negotiation_succeeded;
 }
 
-ssize_t read_with_telnet_handling(int const fd, void * const buf, size_t const buf_len, unsigned int const timeout_seconds)
+static ssize_t strip_telnet_commands(telnet_reader_st * const reader, 
+                                     int const fd, 
+                                     size_t const bytes_read)
 {
-    int bytes_read;
-    unsigned char * out = buf;
-
-    bytes_read = 0;
-    while (bytes_read < buf_len)
+    ssize_t data_length;
+    size_t in;
+    size_t out;
+
+    /* The data is moved down over any telnet commands, so the 
+     * buffer is only ever walked once. A command split across two 
+     * reads is kept in the reader until the rest of it arrives. 
+     */
+    for (in = 0, out = 0; in < bytes_read; in++)
     {
-        int get_char_result;
-        unsigned char ch;
+        unsigned char const ch = reader->buffer[in];
 
-        get_char_result = get_char_with_timeout(fd, timeout_seconds, (char *)&ch);
-        if (get_char_result != 1)
+        if (reader->command_length == 0)
         {
-            if (bytes_read == 0)
+            if (ch == IAC)
             {
-                bytes_read = get_char_result;
+                reader->command[reader->command_length] = ch;
+                reader->command_length++;
             }
-            goto done;
-        }
-        if (ch == IAC)
-        {
-            unsigned char iac_buf[3];
-            ssize_t len;
-
-            iac_buf[0] = ch;
-            // read 2 more bytes
-            len = TEMP_FAILURE_RETRY(read(fd, &iac_buf[1], sizeof iac_buf - 1));
-            if (len <= 0)
+            else
             {
-                bytes_read = -1;
-                goto done;
+                reader->buffer[out] = ch;
+                out++;
             }
-            if (!do_telnet_negotiation(fd, iac_buf, sizeof iac_buf))
+            continue;
+        }
+
+        reader->command[reader->command_length] = ch;
+        reader->command_length++;
+
+        if (reader->command_length == 2)
+        {
+            if (ch == IAC)
             {
-                bytes_read = -1;
-                goto done;
+                /* An escaped 0xff data byte. */
+                reader->buffer[out] = ch;
+                out++;
+                reader->command_length = 0;
             }
-            if (out == NULL)
+            else if (ch < WILL || ch > DONT)
             {
-                goto done;
+                /* A command without an option. Nothing to reply to. */
+                reader->command_length = 0;
             }
+            continue;
         }
-        else
+
+        if (!do_telnet_negotiation(fd, reader->command, reader->command_length))
         {
-            if (out != NULL)
-            {
-                *out = ch;
-                out++;
-            }
-            bytes_read++;
+            data_length = -1;
+            goto done;
         }
+        reader->command_length = 0;
+        reader->commands_handled++;
     }
 
+    data_length = out;
+
 done:
-    return bytes_read;
+    return data_length;
 }
 
-int read_line_with_timeout(char * * output_buffer, size_t * output_buffer_size, int fd, unsigned int timeout_seconds)
+void telnet_reader_init(telnet_reader_st * const reader)
 {
-    size_t total_bytes_read;
-    char const terminator = '\n';
-    char const nul = '\0';
-    int readline_result;
-
-    if (output_buffer_size == NULL || output_buffer == NULL || fd < 0)
-    {
-        errno = EINVAL;
-        return -1;
-    }
+    reader->command_length = 0;
+    reader->commands_handled = 0;
+}
 
-    /* allocate a buffer if none was supplied */
-    if (*output_buffer == NULL)
-    {
-        *output_buffer_size = MIN_ALLOC;
-        *output_buffer = malloc(*output_buffer_size);
-        if (*output_buffer == NULL)
-        {
-            errno = ENOMEM;
-            return -1;
-        }
-    }
+ssize_t telnet_reader_read(telnet_reader_st * const reader, int const fd)
+{
+    ssize_t data_length;
 
-    total_bytes_read = 0;
+    reader->commands_handled = 0;
 
-    for (;;)
+    do
     {
-        char ch;
-        int get_char_result;
+        ssize_t const bytes_read = 
+            TEMP_FAILURE_RETRY(read(fd, reader->buffer, sizeof reader->buffer));
 
-        get_char_result = read_with_telnet_handling(fd, &ch, 1, timeout_seconds);
-        if (get_char_result == -1)
+        if (bytes_read <= 0)
         {
-            readline_result = -1;
+            data_length = bytes_read;
             goto done;
         }
 
-        /* No error. Was anything read? */
-        if (get_char_result == 0)      /* EOF */
-        {
-            /* The final line in a file doesn't need to be terminated with 
-             * '\n'. 
-             */
-            if (total_bytes_read > 0)
-            {
-                break;
-            }
-            readline_result = -1;
-            goto done;
-        }
-        /* read a character */
-
-        /* Ensure we have space to write it to the output buffer */
-        if (total_bytes_read >= *output_buffer_size - 1)    /* must be space for the new char and the NUL terminator */
-        {
-            *output_buffer_size *= 2;
-            *output_buffer = realloc(*output_buffer, *output_buffer_size);
-            if (*output_buffer == NULL)
-            {
-                errno = ENOMEM;
-                readline_result = -1;
-                goto done;
-            }
-        }
-
-        /* add it to the output buffer */
-        (*output_buffer)[total_bytes_read] = ch;
-        total_bytes_read++;
-
-        if (ch == terminator)
-        {
-            break;
-        }
+        data_length = strip_telnet_commands(reader, fd, bytes_read);
     }
-
-    (*output_buffer)[total_bytes_read] = nul;
-    readline_result = total_bytes_read;
+    while (data_length == 0); /* Nothing but telnet commands. */
 
 done:
-    return readline_result;
+    return data_length;
 }
 
@@ -5,7 +5,25 @@
 #include <stdint.h>
 #include <stdio.h>
 
-ssize_t read_with_telnet_handling(int const fd, void * const buf, size_t const buf_len, unsigned int const timeout_seconds);
-int read_line_with_timeout(char * * output_buffer, size_t * output_buffer_size, int fd, unsigned int timeout_seconds);
+#define TELNET_READER_BUFFER_SIZE 256
+
+typedef struct telnet_reader_st
+{
+    unsigned char buffer[TELNET_READER_BUFFER_SIZE];
+    unsigned char command[3];
+    size_t command_length;
+    /* The number of telnet commands answered by the last read. */
+    unsigned int commands_handled;
+} telnet_reader_st;
+
+void telnet_reader_init(telnet_reader_st * const reader);
+
+/* Reads whatever has arrived on the (non-blocking) socket in one 
+ * go. Any telnet commands are answered and removed, and the number 
+ * of data bytes left at the start of reader->buffer is returned. 
+ * 0 is returned at EOF, and -1 on error, with errno set to EAGAIN 
+ * if there is nothing more to read. 
+ */
+ssize_t telnet_reader_read(telnet_reader_st * const reader, int const fd);
 
 #endif /*  __READ_LINE_H__ */
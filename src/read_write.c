@@ -1,97 +1,36 @@
 #include "read_write.h"
-#include "read_line.h"
 
 #include <stddef.h>
 #include <string.h>
-#include <stdlib.h>
-#include <time.h>
 
-bool read_until_string_found(int const sock_fd, char const * const success_string, char const * const failure_string)
+void prompt_matcher_init(prompt_matcher_st * const matcher, char const * const prompt)
 {
-    bool string_found;
-    char * line = NULL;
-    size_t line_length = 0;
-    size_t const success_string_len = strlen(success_string);
-    size_t const failure_string_len = strlen(failure_string);
-    time_t start_time = time(NULL);
-    unsigned int const timeout_seconds = 5;
-
-    do
-    {
-        time_t check_time;
-
-        if (read_line_with_timeout(&line, &line_length, sock_fd, timeout_seconds) < 0)
-        {
-            string_found = false;
-            goto done;
-        }
-
-        /* Ensure the total time taken hasn't been too long. */
-        check_time = time(NULL);
-        if ((check_time - start_time) >= timeout_seconds)
-        {
-            string_found = false;
-            goto done;
-        }
-
-        if (strncmp(line, success_string, success_string_len) == 0)
-        {
-            string_found = true;
-            goto done;
-        }
-        if (failure_string != NULL)
-        {
-            if (strncmp(line, failure_string, failure_string_len) == 0)
-            {
-                string_found = false;
-                goto done;
-            }
-        }
-    }
-    while (1);
-
-done:
-    free(line);
-
-    return string_found;
+    matcher->prompt = prompt;
+    matcher->prompt_char = prompt;
 }
 
-bool wait_for_prompt(int const sock_fd,
-                     char const * const prompt,
-                     unsigned int const maximum_wait_seconds)
+bool prompt_matcher_feed(prompt_matcher_st * const matcher, char const ch)
 {
     bool got_prompt;
-    char ch;
-    int read_result;
-    char const * prompt_char = prompt;
 
-    do
+    if (ch != *matcher->prompt_char)
     {
-        read_result = read_with_telnet_handling(sock_fd, &ch, 1, maximum_wait_seconds);
-        if (read_result != 1)
+        matcher->prompt_char = matcher->prompt;
+    }
+    if (ch == *matcher->prompt_char)
+    {
+        matcher->prompt_char++;
+        if (*matcher->prompt_char == '\0')
         {
-            got_prompt = false;
+            matcher->prompt_char = matcher->prompt;
+            got_prompt = true;
             goto done;
         }
-        if (ch != *prompt_char)
-        {
-            prompt_char = prompt;
-        }
-        if (ch == *prompt_char)
-        {
-            prompt_char++;
-            if (*prompt_char == '\0')
-            {
-                got_prompt = true;
-                goto done;
-            }
-        }
-        else
-        {
-            prompt_char = prompt;
-        }
     }
-    while (1);
+    else
+    {
+        matcher->prompt_char = matcher->prompt;
+    }
 
     got_prompt = false;
 
@@ -99,25 +38,38 @@ done:
     return got_prompt;
 }
 
-bool wait_for_telnet(int const sock_fd)
+void line_reader_init(line_reader_st * const reader)
+{
+    reader->length = 0;
+    reader->line[0] = '\0';
+    reader->complete = false;
+}
+
+bool line_reader_feed(line_reader_st * const reader, char const ch)
 {
-    bool done_telnet;
+    char const terminator = '\n';
 
-    do
+    if (reader->complete)
     {
-        int const read_result = read_with_telnet_handling(sock_fd, NULL, 1, 5);
-        if (read_result == 0)
-        {
-            done_telnet = true;
-            goto done;
-        }
+        line_reader_init(reader);
     }
-    while (1);
 
-    done_telnet = false;
+    /* Lines longer than the buffer are truncated. Only the start
+     * of each line is of interest.
+     */
+    if (reader->length < sizeof reader->line - 1)
+    {
+        reader->line[reader->length] = ch;
+        reader->length++;
+        reader->line[reader->length] = '\0';
+    }
+    reader->complete = ch == terminator;
 
-done:
-    return done_telnet;
+    return reader->complete;
 }
 
+bool line_starts_with(char const * const line, char const * const string)
+{
+    return string != NULL && strncmp(line, string, strlen(string)) == 0;
+}
 
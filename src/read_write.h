@@ -2,11 +2,30 @@
 #define __READ_WRITE_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 
-bool read_until_string_found(int const sock_fd, char const * const success_string, char const * const failure_string);
-bool wait_for_prompt(int const sock_fd,
-                     char const * const prompt,
-                     unsigned int const maximum_wait_seconds);
-bool wait_for_telnet(int const sock_fd);
+#define MAX_LINE_LENGTH 128
+
+/* Incrementally matches a prompt in a stream of characters. */
+typedef struct prompt_matcher_st
+{
+    char const * prompt;
+    char const * prompt_char;
+} prompt_matcher_st;
+
+/* Incrementally assembles characters into '\n' terminated lines. */
+typedef struct line_reader_st
+{
+    char line[MAX_LINE_LENGTH];
+    size_t length;
+    bool complete;
+} line_reader_st;
+
+void prompt_matcher_init(prompt_matcher_st * const matcher, char const * const prompt);
+bool prompt_matcher_feed(prompt_matcher_st * const matcher, char const ch);
+
+void line_reader_init(line_reader_st * const reader);
+bool line_reader_feed(line_reader_st * const reader, char const ch);
+bool line_starts_with(char const * const line, char const * const string);
 
 #endif /* __READ_WRITE_H__ */
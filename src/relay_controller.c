@@ -0,0 +1,910 @@
+#include "relay_controller.h"
+#include "relay_states.h"
+#include "debug.h"
+#include "time_utils.h"
+
+#include <libubox/uloop.h>
+#include <libubox/list.h>
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct relay_controller_st
+{
+    char const * name;
+
+    relay_states_st * current_states;
+    relay_states_st * desired_states;
+    uint64_t last_written_msecs; /* Realtime, for the snapshot. */
+    uint64_t last_confirmed_msecs; /* When current_states was last known to match the module. */
+    uint64_t last_confirmed_realtime_msecs; /* The same, for the snapshot. */
+    unsigned int maximum_state_age_millisecs;
+
+    relay_module_st * relay_module;
+    unsigned int num_relays;
+    uint64_t relays_bitmask;
+    bool verify_writes;
+    unsigned int coalesce_window_millisecs;
+    struct uloop_timeout coalesce_timer;
+    struct list_head waiting_requests; /* Waiting for the desired states to be written. */
+    struct list_head writes_in_progress; /* Oldest first. */
+    struct list_head waiting_reads; /* Waiting for the states to be read from the module. */
+
+    unsigned int reconcile_interval_seconds;
+    struct uloop_timeout reconcile_timer;
+    relay_status_st status;
+
+    gpio_lines_st * gpio_lines;
+    adc_sampler_st * adc_sampler;
+
+    state_changed_fn changed_cb;
+    void * changed_context;
+
+    /* Kept for the snapshot. */
+    bool session_up;
+    unsigned int sessions_ended;
+    uint64_t gpio_inputs;
+    bool gpio_inputs_known;
+    state_snapshot_module_st * snapshot;
+};
+
+typedef struct set_state_request_st
+{
+    struct list_head list;
+    set_state_done_fn done_cb;
+    void * done_context;
+} set_state_request_st;
+
+typedef struct get_states_request_st
+{
+    struct list_head list;
+    get_states_done_fn done_cb;
+    void * done_context;
+} get_states_request_st;
+
+typedef struct relay_module_write_st
+{
+    struct list_head list;
+    relay_controller_st * relay_controller;
+    relay_states_st * written_states;
+    struct list_head requests;
+} relay_module_write_st;
+
+/* The states the module will have once any writes in progress have 
+ * completed. NULL if they aren't known yet. 
+ */
+static relay_states_st const * newest_module_states(relay_controller_st const * const relay_controller)
+{
+    relay_states_st const * newest_states;
+
+    if (!list_empty(&relay_controller->writes_in_progress))
+    {
+        newest_states = 
+            list_last_entry(&relay_controller->writes_in_progress, relay_module_write_st, list)->written_states;
+    }
+    else
+    {
+        newest_states = relay_controller->current_states;
+    }
+
+    return newest_states;
+}
+
+static bool need_to_update_module(relay_controller_st const * const relay_controller,
+                                  uint64_t const writeall_bitmask)
+{
+    bool need_to_write_states;
+    relay_states_st const * const newest_states = newest_module_states(relay_controller);
+
+    if (newest_states == NULL)
+    {
+        /* True if the relay states haven't been updated yet. */
+        need_to_write_states = true;
+    }
+    else if (writeall_bitmask != relay_states_get_states_bitmask(newest_states))
+    {
+        need_to_write_states = true;
+    }
+    else
+    {
+        need_to_write_states = false;
+    }
+
+    return need_to_write_states;
+}
+
+static void set_state_requests_done(struct list_head * const requests, bool const success)
+{
+    while (!list_empty(requests))
+    {
+        set_state_request_st * const request = 
+            list_first_entry(requests, set_state_request_st, list);
+
+        list_del(&request->list);
+        request->done_cb(request->done_context, success);
+        free(request);
+    }
+}
+
+static void publish_snapshot(relay_controller_st const * const relay_controller)
+{
+    state_snapshot_module_st * const snapshot = relay_controller->snapshot;
+    uint32_t flags = 0;
+
+    if (snapshot == NULL)
+    {
+        goto done;
+    }
+
+    if (relay_controller->current_states != NULL)
+    {
+        flags |= STATE_SNAPSHOT_RELAYS_KNOWN;
+    }
+    if (relay_controller->gpio_inputs_known)
+    {
+        flags |= STATE_SNAPSHOT_GPIO_INPUTS_KNOWN;
+    }
+    if (relay_controller->session_up)
+    {
+        flags |= STATE_SNAPSHOT_SESSION_UP;
+    }
+
+    state_snapshot_begin_update(snapshot);
+
+    snapshot->flags = flags;
+    snapshot->num_relays = relay_controller->num_relays;
+    snapshot->relay_states = 
+        (relay_controller->current_states != NULL) 
+        ? relay_states_get_states_bitmask(relay_controller->current_states) : 0;
+    snapshot->gpio_inputs = relay_controller->gpio_inputs;
+    snapshot->last_written_msecs = relay_controller->last_written_msecs;
+    snapshot->last_confirmed_msecs = relay_controller->last_confirmed_realtime_msecs;
+    snapshot->reconciliations = relay_controller->status.reconciliations;
+    snapshot->drifts = relay_controller->status.drifts;
+    snapshot->verify_failures = relay_controller->status.verify_failures;
+    snapshot->sessions_ended = relay_controller->sessions_ended;
+
+    state_snapshot_end_update(snapshot);
+
+done:
+    return;
+}
+
+static void state_changed(void * const changed_context, state_change_st const * const change)
+{
+    relay_controller_st * const relay_controller = changed_context;
+
+    if (change->type == STATE_CHANGE_GPIO_INPUTS)
+    {
+        relay_controller->gpio_inputs = change->states;
+        relay_controller->gpio_inputs_known = true;
+        publish_snapshot(relay_controller);
+    }
+
+    if (relay_controller->changed_cb != NULL)
+    {
+        relay_controller->changed_cb(relay_controller->changed_context, change);
+    }
+}
+
+/* Takes ownership of new_states. */
+static void replace_current_states(relay_controller_st * const relay_controller,
+                                   relay_states_st * const new_states)
+{
+    state_change_st change =
+    {
+        .type = STATE_CHANGE_RELAYS,
+        .states = relay_states_get_states_bitmask(new_states)
+    };
+
+    /* The first states known change all of the relays from unknown. */
+    change.changed = 
+        (relay_controller->current_states != NULL)
+        ? change.states ^ relay_states_get_states_bitmask(relay_controller->current_states)
+        : relay_controller->relays_bitmask;
+
+    relay_states_free(relay_controller->current_states);
+    relay_controller->current_states = new_states;
+    relay_controller->last_confirmed_msecs = monotonic_time_msecs();
+    relay_controller->last_confirmed_realtime_msecs = realtime_msecs();
+    publish_snapshot(relay_controller);
+
+    if (change.changed != 0)
+    {
+        state_changed(relay_controller, &change);
+    }
+}
+
+static bool set_current_states(relay_controller_st * const relay_controller,
+                               uint64_t const states_bitmask)
+{
+    bool set_states;
+    relay_states_st * const read_states = relay_states_create();
+
+    if (read_states == NULL)
+    {
+        set_states = false;
+        goto done;
+    }
+    relay_states_set_states(read_states, relay_controller->relays_bitmask, states_bitmask);
+
+    replace_current_states(relay_controller, read_states);
+
+    set_states = true;
+
+done:
+    return set_states;
+}
+
+static void relay_module_verified_write_done(void * const user_context,
+                                             bool const success,
+                                             uint64_t const states_bitmask)
+{
+    relay_module_write_st * const write = user_context;
+    relay_controller_st * const relay_controller = write->relay_controller;
+    uint64_t const written_bitmask = relay_states_get_states_bitmask(write->written_states);
+    bool verified;
+
+    list_del(&write->list);
+
+    if (!success)
+    {
+        verified = false;
+        goto done;
+    }
+
+    if (!list_empty(&relay_controller->writes_in_progress))
+    {
+        /* The module has been given newer states since, which include 
+         * the ones these requests asked for. This write may even have 
+         * been superseded before it was sent, in which case the states 
+         * read back predate it. Either way they may already be out of 
+         * date, so the newest write updates the current states, and 
+         * the requests are told its result instead. 
+         */
+        relay_module_write_st * const newest_write = 
+            list_last_entry(&relay_controller->writes_in_progress, relay_module_write_st, list);
+
+        list_splice_tail_init(&write->requests, &newest_write->requests);
+        verified = true;
+        goto done;
+    }
+
+    /* Whatever was written, the module's own view of the states is 
+     * now known. 
+     */
+    relay_controller->last_written_msecs = realtime_msecs();
+    set_current_states(relay_controller, states_bitmask);
+
+    verified = states_bitmask == written_bitmask;
+    if (!verified)
+    {
+        relay_controller->status.verify_failures++;
+        publish_snapshot(relay_controller);
+        DPRINTF("%s: relay states not verified: wrote %" PRIx64 ", read %" PRIx64 "\n",
+                relay_controller->name, written_bitmask, states_bitmask);
+    }
+
+done:
+    relay_states_free(write->written_states);
+    set_state_requests_done(&write->requests, verified);
+    free(write);
+
+    return;
+}
+
+static void relay_module_write_done(void * const user_context,
+                                    bool const success,
+                                    bool const superseded)
+{
+    relay_module_write_st * const write = user_context;
+    relay_controller_st * const relay_controller = write->relay_controller;
+
+    if (superseded && !list_is_last(&write->list, &relay_controller->writes_in_progress))
+    {
+        /* These states were never sent to the module, so they mustn't 
+         * become the current states. The next write was made from the 
+         * desired states that followed on from them, and it tells 
+         * these requests its result. 
+         */
+        relay_module_write_st * const next_write = 
+            list_entry(write->list.next, relay_module_write_st, list);
+
+        list_del(&write->list);
+        relay_states_free(write->written_states);
+        list_splice_tail_init(&write->requests, &next_write->requests);
+        goto done;
+    }
+
+    list_del(&write->list);
+
+    if (!success || superseded)
+    {
+        relay_states_free(write->written_states);
+        goto done;
+    }
+
+    /* Save the time when the states were last written. */
+    relay_controller->last_written_msecs = realtime_msecs();
+
+    /* Update the current states after the new states have been 
+     * successfully written to the module. 
+     */
+    replace_current_states(relay_controller, write->written_states);
+
+done:
+    set_state_requests_done(&write->requests, success);
+    free(write);
+
+    return;
+}
+
+static void relay_states_update_module(relay_controller_st * const relay_controller,
+                                       relay_module_priority_t const priority)
+{
+    bool success;
+    uint64_t const writeall_bitmask = 
+        relay_states_get_states_bitmask(relay_controller->desired_states);
+    relay_module_write_st * write;
+
+    /* The current states may be out of date, so they aren't trusted 
+     * in an emergency. 
+     */
+    if (priority != RELAY_MODULE_PRIORITY_EMERGENCY
+        && !need_to_update_module(relay_controller, writeall_bitmask))
+    {
+        /* The module already has these states, or will have once the 
+         * newest write has completed, in which case the requests get 
+         * that write's result. 
+         */
+        if (!list_empty(&relay_controller->writes_in_progress))
+        {
+            relay_module_write_st * const newest_write = 
+                list_last_entry(&relay_controller->writes_in_progress, relay_module_write_st, list);
+
+            list_splice_tail_init(&relay_controller->waiting_requests, &newest_write->requests);
+        }
+        success = true;
+        goto done;
+    }
+
+    /* The module is updated asynchronously. Keep a copy of what 
+     * is being written so the current states can be updated once 
+     * the module has accepted them. 
+     */
+    write = calloc(1, sizeof *write);
+    if (write == NULL)
+    {
+        success = false;
+        goto done;
+    }
+    INIT_LIST_HEAD(&write->requests);
+    write->relay_controller = relay_controller;
+    write->written_states = relay_states_combine(NULL, relay_controller->desired_states);
+
+    if (write->written_states == NULL)
+    {
+        free(write);
+        success = false;
+        goto done;
+    }
+
+    /* Everyone waiting now gets told the result of this write. */
+    list_splice_tail_init(&relay_controller->waiting_requests, &write->requests);
+    list_add_tail(&write->list, &relay_controller->writes_in_progress);
+
+    bool const submitted = 
+        relay_controller->verify_writes
+        ? update_relay_module_verified(relay_controller->relay_module, priority, writeall_bitmask, relay_module_verified_write_done, write)
+        : update_relay_module(relay_controller->relay_module, priority, writeall_bitmask, relay_module_write_done, write);
+
+    if (!submitted)
+    {
+        list_del(&write->list);
+        list_splice_tail_init(&write->requests, &relay_controller->waiting_requests);
+        relay_states_free(write->written_states);
+        free(write);
+        success = false;
+        goto done;
+    }
+
+    /* relay_module_write_done() reports the result. */
+    success = true;
+
+done:
+    set_state_requests_done(&relay_controller->waiting_requests, success);
+
+    return;
+}
+
+static void coalesce_timer_handler(struct uloop_timeout * const timeout)
+{
+    relay_controller_st * const relay_controller = 
+        container_of(timeout, relay_controller_st, coalesce_timer);
+
+    relay_states_update_module(relay_controller, RELAY_MODULE_PRIORITY_USER);
+}
+
+static void change_desired_states(relay_controller_st * const relay_controller,
+                                  relay_states_st const * const desired_relay_states,
+                                  relay_module_priority_t const priority,
+                                  set_state_done_fn const done_cb,
+                                  void * const done_context)
+{
+    relay_states_st * desired_states;
+    set_state_request_st * request = NULL;
+
+    if (done_cb != NULL)
+    {
+        request = calloc(1, sizeof *request);
+        if (request == NULL)
+        {
+            done_cb(done_context, false);
+            goto done;
+        }
+        request->done_cb = done_cb;
+        request->done_context = done_context;
+    }
+
+    /* Overlay the new states onto the desired states. The new 
+     * request may not want to change the states of all the 
+     * relays. Earlier requests may not have been written to the 
+     * module yet, so the desired states are used rather than the 
+     * current ones. 
+     */
+    desired_states = relay_states_combine(relay_controller->desired_states, desired_relay_states);
+    if (desired_states == NULL)
+    {
+        if (request != NULL)
+        {
+            done_cb(done_context, false);
+            free(request);
+        }
+        goto done;
+    }
+    relay_states_free(relay_controller->desired_states);
+    relay_controller->desired_states = desired_states;
+
+    if (request != NULL)
+    {
+        list_add_tail(&request->list, &relay_controller->waiting_requests);
+    }
+
+    if (priority == RELAY_MODULE_PRIORITY_EMERGENCY)
+    {
+        /* Don't wait for anything. */
+        uloop_timeout_cancel(&relay_controller->coalesce_timer);
+        relay_states_update_module(relay_controller, priority);
+    }
+    else if (relay_controller->coalesce_window_millisecs == 0)
+    {
+        relay_states_update_module(relay_controller, priority);
+    }
+    else if (!relay_controller->coalesce_timer.pending)
+    {
+        /* Give any other requests that arrive shortly a chance to 
+         * be merged with this one. 
+         */
+        uloop_timeout_set(&relay_controller->coalesce_timer, 
+                          relay_controller->coalesce_window_millisecs);
+    }
+
+done:
+    return;
+}
+
+static void set_state_handler(void * const user_info,
+                              relay_states_st * const desired_relay_states,
+                              set_state_done_fn const done_cb,
+                              void * const done_context)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    change_desired_states(relay_controller, 
+                          desired_relay_states, 
+                          RELAY_MODULE_PRIORITY_USER, 
+                          done_cb, 
+                          done_context);
+}
+
+static void all_off_handler(void * const user_info,
+                            set_state_done_fn const done_cb,
+                            void * const done_context)
+{
+    relay_controller_st * const relay_controller = user_info;
+    relay_states_st * const all_off_states = relay_states_create();
+
+    if (all_off_states == NULL)
+    {
+        if (done_cb != NULL)
+        {
+            done_cb(done_context, false);
+        }
+        goto done;
+    }
+    relay_states_set_states(all_off_states, relay_controller->relays_bitmask, 0);
+
+    change_desired_states(relay_controller, 
+                          all_off_states, 
+                          RELAY_MODULE_PRIORITY_EMERGENCY, 
+                          done_cb, 
+                          done_context);
+
+done:
+    relay_states_free(all_off_states);
+}
+
+static void get_states_requests_done(struct list_head * const requests,
+                                     bool const success,
+                                     uint64_t const states_bitmask)
+{
+    while (!list_empty(requests))
+    {
+        get_states_request_st * const request = 
+            list_first_entry(requests, get_states_request_st, list);
+
+        list_del(&request->list);
+        request->done_cb(request->done_context, success, states_bitmask);
+        free(request);
+    }
+}
+
+static void relay_module_read_done(void * const user_context,
+                                   bool const success,
+                                   uint64_t const states_bitmask)
+{
+    relay_controller_st * const relay_controller = user_context;
+    LIST_HEAD(requests);
+
+    /* Requests that arrive while the callbacks are being run will 
+     * need a new read. 
+     */
+    list_splice_tail_init(&relay_controller->waiting_reads, &requests);
+
+    if (success)
+    {
+        set_current_states(relay_controller, states_bitmask);
+    }
+
+    get_states_requests_done(&requests, success, states_bitmask);
+
+    return;
+}
+
+static bool current_states_are_fresh(relay_controller_st const * const relay_controller)
+{
+    return relay_controller->current_states != NULL
+           && monotonic_time_msecs() - relay_controller->last_confirmed_msecs 
+              < relay_controller->maximum_state_age_millisecs;
+}
+
+static void read_states_from_module(relay_controller_st * const relay_controller,
+                                    relay_module_priority_t const priority,
+                                    get_states_done_fn const done_cb,
+                                    void * const done_context)
+{
+    get_states_request_st * request;
+    bool read_in_progress;
+
+    request = calloc(1, sizeof *request);
+    if (request == NULL)
+    {
+        done_cb(done_context, false, 0);
+        goto done;
+    }
+    request->done_cb = done_cb;
+    request->done_context = done_context;
+
+    /* Only one read is done at a time. Everyone waiting gets the 
+     * result of that read. 
+     */
+    read_in_progress = !list_empty(&relay_controller->waiting_reads);
+    list_add_tail(&request->list, &relay_controller->waiting_reads);
+
+    if (!read_in_progress
+        && !relay_module_read_relay_states(relay_controller->relay_module, priority, relay_module_read_done, relay_controller))
+    {
+        get_states_requests_done(&relay_controller->waiting_reads, false, 0);
+    }
+
+done:
+    return;
+}
+
+static void get_states_handler(void * const user_info,
+                               get_states_done_fn const done_cb,
+                               void * const done_context)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    if (current_states_are_fresh(relay_controller))
+    {
+        done_cb(done_context, true, relay_states_get_states_bitmask(relay_controller->current_states));
+    }
+    else
+    {
+        read_states_from_module(relay_controller, RELAY_MODULE_PRIORITY_USER, done_cb, done_context);
+    }
+}
+
+static void reconcile_read_done(void * const done_context,
+                                bool const success,
+                                uint64_t const states_bitmask)
+{
+    relay_controller_st * const relay_controller = done_context;
+
+    if (relay_controller->reconcile_interval_seconds > 0)
+    {
+        uloop_timeout_set(&relay_controller->reconcile_timer, 
+                          relay_controller->reconcile_interval_seconds * 1000);
+    }
+
+    if (!success || relay_controller->desired_states == NULL)
+    {
+        /* Nothing to compare against. */
+        goto done;
+    }
+    if (!list_empty(&relay_controller->writes_in_progress) || relay_controller->coalesce_timer.pending)
+    {
+        /* The states are about to be written anyway, and the read 
+         * may have been done before the last write. 
+         */
+        goto done;
+    }
+
+    relay_controller->status.reconciliations++;
+
+    uint64_t const desired_bitmask = 
+        relay_states_get_states_bitmask(relay_controller->desired_states);
+
+    if (states_bitmask != desired_bitmask)
+    {
+        /* The module has lost the states we gave it, probably because 
+         * it has been reset. The read has updated the current states, 
+         * so the desired states will be written again. 
+         */
+        relay_controller->status.drifts++;
+        DPRINTF("%s: relay states drifted: module %" PRIx64 ", desired %" PRIx64 "\n", 
+                relay_controller->name, states_bitmask, desired_bitmask);
+        relay_states_update_module(relay_controller, RELAY_MODULE_PRIORITY_RECONCILE);
+    }
+    publish_snapshot(relay_controller);
+
+done:
+    return;
+}
+
+static void reconcile_timer_handler(struct uloop_timeout * const timeout)
+{
+    relay_controller_st * const relay_controller = 
+        container_of(timeout, relay_controller_st, reconcile_timer);
+
+    read_states_from_module(relay_controller, RELAY_MODULE_PRIORITY_RECONCILE, reconcile_read_done, relay_controller);
+}
+
+static void relay_module_session_changed(void * const user_context, bool const established)
+{
+    relay_controller_st * const relay_controller = user_context;
+
+    relay_controller->session_up = established;
+    if (!established)
+    {
+        relay_controller->sessions_ended++;
+    }
+    publish_snapshot(relay_controller);
+
+    if (!established)
+    {
+        goto done;
+    }
+
+    /* The session may have been lost because the module was reset, 
+     * so check its states straight away. This also fills in the 
+     * current states when the daemon starts. 
+     */
+    read_states_from_module(relay_controller, RELAY_MODULE_PRIORITY_RECONCILE, reconcile_read_done, relay_controller);
+    gpio_lines_module_connected(relay_controller->gpio_lines);
+
+done:
+    return;
+}
+
+static void get_status_handler(void * const user_info, relay_status_st * const status)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    *status = relay_controller->status;
+}
+
+static size_t get_relay_count_handler(void * const user_info)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    return relay_controller->num_relays;
+}
+
+static size_t get_gpio_count_handler(void * const user_info, gpio_direction_t const direction)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    return gpio_lines_count(relay_controller->gpio_lines, direction);
+}
+
+static void get_gpio_states_handler(void * const user_info,
+                                    gpio_direction_t const direction,
+                                    get_states_done_fn const done_cb,
+                                    void * const done_context)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    gpio_lines_get_states(relay_controller->gpio_lines, direction, done_cb, done_context);
+}
+
+static void set_gpio_output_handler(void * const user_info,
+                                    unsigned int const output,
+                                    bool const state,
+                                    set_state_done_fn const done_cb,
+                                    void * const done_context)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    gpio_lines_set_output(relay_controller->gpio_lines, output, state, done_cb, done_context);
+}
+
+static bool get_adc_stats_handler(void * const user_info,
+                                  unsigned int const channel,
+                                  unsigned int const window_millisecs,
+                                  adc_stats_st * const stats)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    return adc_sampler_get_stats(relay_controller->adc_sampler, channel, window_millisecs, stats);
+}
+
+static void set_state_changed_handler(void * const user_info,
+                                      state_changed_fn const changed_cb,
+                                      void * const changed_context)
+{
+    relay_controller_st * const relay_controller = user_info;
+
+    relay_controller->changed_cb = changed_cb;
+    relay_controller->changed_context = changed_context;
+}
+
+static message_handler_st const relay_controller_handlers =
+{
+    .set_state_handler = set_state_handler,
+    .get_states_handler = get_states_handler,
+    .get_relay_count_handler = get_relay_count_handler,
+    .get_status_handler = get_status_handler,
+    .all_off_handler = all_off_handler,
+    .get_gpio_count_handler = get_gpio_count_handler,
+    .get_gpio_states_handler = get_gpio_states_handler,
+    .set_gpio_output_handler = set_gpio_output_handler,
+    .get_adc_stats_handler = get_adc_stats_handler,
+    .set_state_changed_handler = set_state_changed_handler
+};
+
+message_handler_st const * relay_controller_message_handlers(void)
+{
+    return &relay_controller_handlers;
+}
+
+relay_controller_st * relay_controller_create(char const * const name,
+                                              relay_module_info_st const * const relay_module_info,
+                                              relay_controller_settings_st const * const settings)
+{
+    relay_controller_st * relay_controller = calloc(1, sizeof *relay_controller);
+
+    if (relay_controller == NULL)
+    {
+        goto done;
+    }
+
+    relay_controller->relay_module = relay_module_create(relay_module_info, 
+                                                         &settings->module_settings,
+                                                         relay_module_session_changed, 
+                                                         relay_controller);
+    if (relay_controller->relay_module == NULL)
+    {
+        free(relay_controller);
+        relay_controller = NULL;
+        goto done;
+    }
+
+    relay_controller->gpio_lines = gpio_lines_create(name, 
+                                                     relay_controller->relay_module, 
+                                                     &settings->gpio_settings,
+                                                     state_changed,
+                                                     relay_controller);
+    relay_controller->adc_sampler = adc_sampler_create(relay_controller->relay_module, 
+                                                       &settings->adc_settings,
+                                                       state_changed,
+                                                       relay_controller);
+    if (relay_controller->gpio_lines == NULL || relay_controller->adc_sampler == NULL)
+    {
+        relay_module_free(relay_controller->relay_module);
+        gpio_lines_free(relay_controller->gpio_lines);
+        adc_sampler_free(relay_controller->adc_sampler);
+        free(relay_controller);
+        relay_controller = NULL;
+        goto done;
+    }
+
+    relay_controller->name = name;
+    relay_controller->num_relays = settings->module_settings.num_relays;
+    relay_controller->relays_bitmask = numato_relays_bitmask(relay_controller->num_relays);
+    relay_controller->coalesce_window_millisecs = settings->coalesce_window_millisecs;
+    relay_controller->maximum_state_age_millisecs = settings->maximum_state_age_millisecs;
+    relay_controller->verify_writes = settings->verify_writes;
+    relay_controller->coalesce_timer.cb = coalesce_timer_handler;
+    INIT_LIST_HEAD(&relay_controller->waiting_requests);
+    INIT_LIST_HEAD(&relay_controller->waiting_reads);
+    INIT_LIST_HEAD(&relay_controller->writes_in_progress);
+
+    relay_controller->reconcile_interval_seconds = settings->reconcile_interval_seconds;
+    relay_controller->reconcile_timer.cb = reconcile_timer_handler;
+    if (relay_controller->reconcile_interval_seconds > 0)
+    {
+        uloop_timeout_set(&relay_controller->reconcile_timer, 
+                          relay_controller->reconcile_interval_seconds * 1000);
+    }
+
+    /* Log in now so that the first request doesn't have to wait 
+     * for it. 
+     */
+    relay_module_start(relay_controller->relay_module);
+
+done:
+    return relay_controller;
+}
+
+void relay_controller_publish_snapshot(relay_controller_st * const relay_controller,
+                                       state_snapshot_module_st * const snapshot)
+{
+    relay_controller->snapshot = snapshot;
+
+    if (snapshot != NULL)
+    {
+        /* The name doesn't change, so it is filled in once. */
+        state_snapshot_begin_update(snapshot);
+        strncpy(snapshot->name, 
+                (relay_controller->name != NULL) ? relay_controller->name : "", 
+                sizeof snapshot->name - 1);
+        state_snapshot_end_update(snapshot);
+    }
+
+    publish_snapshot(relay_controller);
+}
+
+void relay_controller_free(relay_controller_st * const relay_controller)
+{
+    if (relay_controller == NULL)
+    {
+        goto done;
+    }
+
+    /* Freeing the module fails any outstanding commands, which 
+     * completes any requests still waiting on them. 
+     */
+    relay_module_free(relay_controller->relay_module);
+    set_state_requests_done(&relay_controller->waiting_requests, false);
+
+    /* The timers are only cancelled now, as the failed commands may 
+     * have armed them again. A failed reconcile read always does. 
+     */
+    uloop_timeout_cancel(&relay_controller->coalesce_timer);
+    uloop_timeout_cancel(&relay_controller->reconcile_timer);
+    gpio_lines_free(relay_controller->gpio_lines);
+    adc_sampler_free(relay_controller->adc_sampler);
+
+    relay_states_free(relay_controller->current_states);
+    relay_states_free(relay_controller->desired_states);
+
+    free(relay_controller);
+
+done:
+    return;
+}
@@ -0,0 +1,41 @@
+#ifndef __RELAY_CONTROLLER_H__
+#define __RELAY_CONTROLLER_H__
+
+#include "relay_module.h"
+#include "message_handler.h"
+#include "gpio_lines.h"
+#include "adc_sampler.h"
+#include "state_snapshot.h"
+
+/* A relay controller keeps track of the states of the relays on 
+ * a single module, and keeps the module up to date with them. It 
+ * also looks after the module's GPIO lines and ADC inputs. 
+ */
+typedef struct relay_controller_st relay_controller_st;
+
+typedef struct relay_controller_settings_st
+{
+    unsigned int coalesce_window_millisecs;
+    unsigned int maximum_state_age_millisecs;
+    unsigned int reconcile_interval_seconds;
+    bool verify_writes; /* Read the states back after writing them. */
+    relay_module_settings_st module_settings;
+    gpio_lines_settings_st gpio_settings;
+    adc_sampler_settings_st adc_settings;
+} relay_controller_settings_st;
+
+relay_controller_st * relay_controller_create(char const * const name,
+                                              relay_module_info_st const * const relay_module_info,
+                                              relay_controller_settings_st const * const settings);
+void relay_controller_free(relay_controller_st * const relay_controller);
+
+/* Keeps the module's entry in the state snapshot up to date from 
+ * now on. 
+ */
+void relay_controller_publish_snapshot(relay_controller_st * const relay_controller,
+                                       state_snapshot_module_st * const snapshot);
+
+/* The handlers expect the relay controller as their user_info. */
+message_handler_st const * relay_controller_message_handlers(void);
+
+#endif /* __RELAY_CONTROLLER_H__ */
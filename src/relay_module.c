@@ -1,171 +1,1593 @@
 #include "relay_module.h"
+#include "read_line.h"
 #include "read_write.h"
 #include "socket.h"
+#include "address_resolver.h"
+#include "time_utils.h"
+#include "relay_states.h"
+#include "debug.h"
 
+#include <libubox/uloop.h>
+#include <libubox/list.h>
+#include <libubox/utils.h>
+
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#define PROMPT_WAIT_SECONDS 5
+#define TELNET_WAIT_MILLISECS 5000
+#define RECONNECT_DELAY_MILLISECS 1000
+
+/* While the module can't be reached, commands are failed straight 
+ * away instead of each one trying to connect. The module is 
+ * retried in the background, waiting twice as long after each 
+ * failure, up to this limit. 
+ */
+#define MINIMUM_BACKOFF_MILLISECS 1000
+#define MAXIMUM_BACKOFF_MILLISECS 60000
+
+/* A session that is closed for being idle and then needed again 
+ * soon afterwards has its idle period doubled, up to this many 
+ * times the configured period, so that a module used at intervals 
+ * just longer than the idle period doesn't log in for every 
+ * command. 
+ */
+#define MAXIMUM_IDLE_MULTIPLIER 8
+
+static char const keepalive_command[] = "ver";
+
+static char const * const session_mode_strings[] =
+{
+    [RELAY_MODULE_SESSION_PERSISTENT] = "persistent",
+    [RELAY_MODULE_SESSION_KEEPALIVE] = "keepalive",
+    [RELAY_MODULE_SESSION_IDLE_CLOSE] = "idle_close"
+};
+
+#define MAX_COMMAND_LENGTH 64
+#define MAX_RESPONSE_LENGTH 128
+
+static char const username_prompt[] = "User Name: ";
+static char const password_prompt[] = "Password: ";
+static char const command_prompt[] = ">";
+static char const login_success_string[] = "Logged in successfully";
+static char const login_failure_string[] = "Access denied";
+
+/* The session with the module is driven entirely by uloop
+ * events, so that a slow or unresponsive module never blocks
+ * the daemon. Each state waits for some input from the module.
+ * Connecting, logging in and each command are operations with an 
+ * absolute deadline shared by all of their states, and the session 
+ * is torn down if an operation hasn't completed by its deadline. 
+ */
+typedef enum relay_module_state_t
+{
+    RELAY_MODULE_STATE_DISCONNECTED,
+    RELAY_MODULE_STATE_RESOLVING,
+    RELAY_MODULE_STATE_CONNECTING,
+    RELAY_MODULE_STATE_WAIT_USERNAME_PROMPT,
+    RELAY_MODULE_STATE_WAIT_PASSWORD_PROMPT,
+    RELAY_MODULE_STATE_WAIT_TELNET,
+    RELAY_MODULE_STATE_WAIT_LOGIN_RESULT,
+    RELAY_MODULE_STATE_WAIT_LOGIN_PROMPT,
+    RELAY_MODULE_STATE_IDLE,
+    RELAY_MODULE_STATE_WAIT_COMMAND_PROMPT
+} relay_module_state_t;
+
+typedef struct relay_module_command_st
+{
+    struct list_head list;
+    char command[MAX_COMMAND_LENGTH];
+    relay_module_command_done_fn done_cb;
+    relay_module_write_done_fn write_done_cb; /* Used instead of done_cb for writes. */
+    void * user_context;
+    uint64_t deadline_msecs;
+    bool is_write;
+    /* Older writes replaced by this one, which share its result. */
+    struct list_head superseded_writes;
+} relay_module_command_st;
+
+typedef struct relay_module_verified_write_st
+{
+    unsigned int pending; /* Commands still to complete. */
+    bool wrote_states;
+    bool read_states;
+    uint64_t states_bitmask;
+    relay_module_read_done_fn done_cb;
+    void * user_context;
+} relay_module_verified_write_st;
+
+typedef struct relay_module_read_st
+{
+    char command[MAX_COMMAND_LENGTH];
+    relay_module_read_done_fn done_cb;
+    void * user_context;
+} relay_module_read_st;
+
+typedef struct relay_module_adc_read_st
+{
+    char command[MAX_COMMAND_LENGTH];
+    relay_module_adc_read_done_fn done_cb;
+    void * user_context;
+} relay_module_adc_read_st;
+
+typedef struct relay_module_gpio_read_st
+{
+    unsigned int pending; /* Commands still to complete. */
+    bool read_states;
+    uint64_t states_bitmask;
+    relay_module_read_done_fn done_cb;
+    void * user_context;
+} relay_module_gpio_read_st;
+
+typedef struct relay_module_gpio_line_read_st
+{
+    char command[MAX_COMMAND_LENGTH];
+    unsigned int gpio;
+    relay_module_gpio_read_st * gpio_read;
+} relay_module_gpio_line_read_st;
+
+struct relay_module_st
+{
+    relay_module_info_st const * info;
+    relay_module_settings_st settings;
+    int writeall_digits;
+    relay_module_session_fn session_cb;
+    void * user_context;
+    bool keep_connected;
+    struct uloop_timeout reconnect_timer;
+    struct addrinfo * addresses;
+    struct addrinfo const * next_address;
+    address_resolver_st * resolver; /* Non-NULL while the address is being resolved. */
+    unsigned int connect_failures; /* Consecutive failures to establish a session. */
+    struct uloop_timeout idle_timer;
+    unsigned int idle_millisecs;
+    uint64_t idle_closed_msecs; /* When the session was last closed for being idle. */
+
+    relay_module_state_t state;
+    struct uloop_fd fd;
+    struct uloop_timeout timeout;
+    uint64_t deadline_msecs;
+    unsigned int disconnect_count;
+    telnet_reader_st telnet_reader;
+    prompt_matcher_st prompt_matcher;
+    line_reader_st line_reader;
+
+    struct list_head queued_commands[RELAY_MODULE_PRIORITY_COUNT];
+    /* Commands that have been sent to the module, in the order that 
+     * their responses will arrive. 
+     */
+    struct list_head sent_commands;
+    unsigned int commands_in_flight;
+    char response[MAX_RESPONSE_LENGTH];
+    size_t response_length;
+};
+
+static void relay_module_process_queue(relay_module_st * const relay_module);
+static void relay_module_connect_next_address(relay_module_st * const relay_module);
+
+static bool relay_module_is_logged_in(relay_module_st const * const relay_module)
+{
+    return relay_module->state == RELAY_MODULE_STATE_IDLE
+           || relay_module->state == RELAY_MODULE_STATE_WAIT_COMMAND_PROMPT;
+}
+
+static void relay_module_set_state(relay_module_st * const relay_module,
+                                   relay_module_state_t const state)
+{
+    relay_module->state = state;
+    if (state == RELAY_MODULE_STATE_DISCONNECTED || state == RELAY_MODULE_STATE_IDLE)
+    {
+        uloop_timeout_cancel(&relay_module->timeout);
+    }
+}
+
+static void relay_module_arm_timeout(relay_module_st * const relay_module,
+                                     uint64_t const deadline_msecs)
+{
+    uint64_t const now_msecs = monotonic_time_msecs();
+    uint64_t const remaining_msecs = 
+        (deadline_msecs > now_msecs) ? deadline_msecs - now_msecs : 0;
+
+    uloop_timeout_set(&relay_module->timeout, remaining_msecs);
+}
+
+static void relay_module_start_operation(relay_module_st * const relay_module,
+                                         unsigned int const timeout_millisecs)
+{
+    relay_module->deadline_msecs = monotonic_time_msecs() + timeout_millisecs;
+    relay_module_arm_timeout(relay_module, relay_module->deadline_msecs);
+}
+
+static void relay_module_wait_for_prompt(relay_module_st * const relay_module,
+                                         relay_module_state_t const state,
+                                         char const * const prompt)
+{
+    prompt_matcher_init(&relay_module->prompt_matcher, prompt);
+    relay_module_set_state(relay_module, state);
+}
+
+static void relay_module_disconnect(relay_module_st * const relay_module)
+{
+    bool const was_logged_in = relay_module_is_logged_in(relay_module);
+
+    if (relay_module->fd.fd >= 0)
+    {
+        uloop_fd_delete(&relay_module->fd);
+        close(relay_module->fd.fd);
+        relay_module->fd.fd = -1;
+        relay_module->disconnect_count++;
+        uloop_timeout_cancel(&relay_module->idle_timer);
+    }
+    relay_module_set_state(relay_module, RELAY_MODULE_STATE_DISCONNECTED);
+
+    if (was_logged_in && relay_module->session_cb != NULL)
+    {
+        relay_module->session_cb(relay_module->user_context, false);
+    }
+}
+
+static void relay_module_finish_command(relay_module_command_st * const relay_command,
+                                        bool const success,
+                                        bool const superseded,
+                                        char const * const response)
+{
+    /* The writes that this one replaced were never sent, and finish 
+     * ahead of it in the order they were submitted. 
+     */
+    while (!list_empty(&relay_command->superseded_writes))
+    {
+        relay_module_command_st * const superseded_command =
+            list_first_entry(&relay_command->superseded_writes, relay_module_command_st, list);
+
+        list_del(&superseded_command->list);
+        relay_module_finish_command(superseded_command, success, true, response);
+    }
+
+    if (relay_command->is_write)
+    {
+        if (relay_command->write_done_cb != NULL)
+        {
+            relay_command->write_done_cb(relay_command->user_context, success, superseded);
+        }
+    }
+    else if (relay_command->done_cb != NULL)
+    {
+        relay_command->done_cb(relay_command->user_context, success, response);
+    }
+    free(relay_command);
+}
+
+static void relay_module_complete_command(relay_module_command_st * const relay_command,
+                                          bool const success,
+                                          char const * const response)
+{
+    relay_module_finish_command(relay_command, success, false, response);
+}
+
+static void relay_module_fail_commands(struct list_head * const commands)
+{
+    while (!list_empty(commands))
+    {
+        relay_module_command_st * const relay_command =
+            list_first_entry(commands, relay_module_command_st, list);
+
+        list_del(&relay_command->list);
+        relay_module_complete_command(relay_command, false, "");
+    }
+}
+
+static relay_module_command_st * relay_module_next_queued_command(relay_module_st * const relay_module)
+{
+    relay_module_command_st * relay_command;
+    relay_module_priority_t priority;
+
+    for (priority = 0; priority < RELAY_MODULE_PRIORITY_COUNT; priority++)
+    {
+        if (!list_empty(&relay_module->queued_commands[priority]))
+        {
+            relay_command = 
+                list_first_entry(&relay_module->queued_commands[priority], relay_module_command_st, list);
+            goto done;
+        }
+    }
+
+    relay_command = NULL;
+
+done:
+    return relay_command;
+}
+
+static void relay_module_splice_queued_commands(relay_module_st * const relay_module,
+                                                struct list_head * const commands)
+{
+    relay_module_priority_t priority;
+
+    for (priority = 0; priority < RELAY_MODULE_PRIORITY_COUNT; priority++)
+    {
+        list_splice_tail_init(&relay_module->queued_commands[priority], commands);
+    }
+}
+
+/* Returns the priority to queue the new write at, which is the most 
+ * urgent of its own priority and those of the writes it supersedes, 
+ * so that superseding an emergency write doesn't delay it. 
+ */
+static relay_module_priority_t relay_module_supersede_queued_writes(relay_module_st * const relay_module,
+                                                                    relay_module_command_st * const relay_write,
+                                                                    relay_module_priority_t const write_priority)
+{
+    relay_module_priority_t queue_priority = write_priority;
+    relay_module_priority_t priority;
+
+    /* A write sets the states of all of the relays, so any older 
+     * write still in the queue must not be sent after it. This 
+     * matters because the queue isn't drained in the order that the 
+     * commands were submitted. 
+     */
+    for (priority = 0; priority < RELAY_MODULE_PRIORITY_COUNT; priority++)
+    {
+        relay_module_command_st * relay_command;
+        relay_module_command_st * tmp;
+
+        list_for_each_entry_safe(relay_command, tmp, &relay_module->queued_commands[priority], list)
+        {
+            if (relay_command->is_write)
+            {
+                list_move_tail(&relay_command->list, &relay_write->superseded_writes);
+                if (priority < queue_priority)
+                {
+                    queue_priority = priority;
+                }
+            }
+        }
+    }
+
+    return queue_priority;
+}
+
+static bool relay_module_circuit_is_open(relay_module_st const * const relay_module)
+{
+    return relay_module->connect_failures > 0 
+           && relay_module->state == RELAY_MODULE_STATE_DISCONNECTED;
+}
+
+static unsigned int relay_module_backoff_millisecs(relay_module_st const * const relay_module)
+{
+    unsigned int backoff_millisecs = MINIMUM_BACKOFF_MILLISECS;
+    unsigned int failures;
+
+    for (failures = 1; 
+         failures < relay_module->connect_failures && backoff_millisecs < MAXIMUM_BACKOFF_MILLISECS; 
+         failures++)
+    {
+        backoff_millisecs *= 2;
+    }
+    if (backoff_millisecs > MAXIMUM_BACKOFF_MILLISECS)
+    {
+        backoff_millisecs = MAXIMUM_BACKOFF_MILLISECS;
+    }
+
+    return backoff_millisecs;
+}
+
+static void relay_module_session_failed(relay_module_st * const relay_module)
+{
+    bool const was_logged_in = relay_module_is_logged_in(relay_module);
+    LIST_HEAD(failed_commands);
+
+    relay_module_disconnect(relay_module);
+
+    /* The responses to any commands that were sent have been lost. */
+    list_splice_tail_init(&relay_module->sent_commands, &failed_commands);
+    relay_module->commands_in_flight = 0;
+
+    if (!was_logged_in)
+    {
+        /* Couldn't connect or log in, so there is no point trying
+         * to run any of the other queued commands.
+         */
+        relay_module_splice_queued_commands(relay_module, &failed_commands);
+        relay_module->connect_failures++;
+    }
+
+    relay_module_fail_commands(&failed_commands);
+
+    if (was_logged_in)
+    {
+        /* Any remaining commands get a new session. */
+        relay_module_process_queue(relay_module);
+    }
+
+    if (relay_module->state != RELAY_MODULE_STATE_DISCONNECTED)
+    {
+        goto done;
+    }
+
+    if (relay_module_circuit_is_open(relay_module))
+    {
+        unsigned int const backoff_millisecs = relay_module_backoff_millisecs(relay_module);
+
+        DPRINTF("relay module %s is unreachable. Retrying in %u ms\n", 
+                relay_module->info->address, backoff_millisecs);
+        uloop_timeout_set(&relay_module->reconnect_timer, backoff_millisecs);
+    }
+    else if (relay_module->keep_connected)
+    {
+        /* Re-establish the session in the background, so that it's
+         * ready for the next command.
+         */
+        uloop_timeout_set(&relay_module->reconnect_timer, RECONNECT_DELAY_MILLISECS);
+    }
+
+done:
+    return;
+}
+
+static void relay_module_wait_for_command(relay_module_st * const relay_module)
+{
+    relay_module_command_st * const relay_command =
+        list_first_entry(&relay_module->sent_commands, relay_module_command_st, list);
+
+    relay_module->deadline_msecs = relay_command->deadline_msecs;
+    relay_module_arm_timeout(relay_module, relay_module->deadline_msecs);
+}
+
+static void relay_module_send_next_command(relay_module_st * const relay_module)
+{
+    relay_module_command_st * const relay_command = relay_module_next_queued_command(relay_module);
+    bool const was_idle = relay_module->state == RELAY_MODULE_STATE_IDLE;
+
+    uloop_timeout_cancel(&relay_module->idle_timer);
+
+    list_move_tail(&relay_command->list, &relay_module->sent_commands);
+    relay_module->commands_in_flight++;
+    relay_command->deadline_msecs = 
+        monotonic_time_msecs() + relay_module->settings.command_millisecs;
+
+    if (dprintf(relay_module->fd.fd, "%s\r\n", relay_command->command) < 0)
+    {
+        relay_module_session_failed(relay_module);
+        goto done;
+    }
+
+    if (was_idle)
+    {
+        relay_module->response_length = 0;
+        relay_module->response[0] = '\0';
+        relay_module_wait_for_prompt(relay_module, RELAY_MODULE_STATE_WAIT_COMMAND_PROMPT, command_prompt);
+        relay_module_wait_for_command(relay_module);
+    }
+
+done:
+    return;
+}
+
+static void relay_module_send_queued_commands(relay_module_st * const relay_module)
+{
+    unsigned int const disconnect_count = relay_module->disconnect_count;
+    unsigned int const pipeline_depth = 
+        (relay_module->settings.pipeline_depth > 0) ? relay_module->settings.pipeline_depth : 1;
+
+    /* Up to pipeline_depth commands are sent without waiting for 
+     * the responses to the earlier ones. The module deals with them 
+     * in turn, so the responses are matched to the commands in the 
+     * order they were sent. 
+     */
+    while (relay_module_next_queued_command(relay_module) != NULL
+           && relay_module->commands_in_flight < pipeline_depth
+           && relay_module->disconnect_count == disconnect_count)
+    {
+        relay_module_send_next_command(relay_module);
+    }
+}
+
+static void relay_module_command_completed(relay_module_st * const relay_module)
+{
+    relay_module_command_st * const relay_command =
+        list_first_entry(&relay_module->sent_commands, relay_module_command_st, list);
+    size_t const prompt_length = strlen(command_prompt);
+
+    /* Don't include the prompt in the response. */
+    if (relay_module->response_length >= prompt_length
+        && memcmp(&relay_module->response[relay_module->response_length - prompt_length],
+                  command_prompt,
+                  prompt_length) == 0)
+    {
+        relay_module->response_length -= prompt_length;
+        relay_module->response[relay_module->response_length] = '\0';
+    }
+
+    list_del(&relay_command->list);
+    relay_module->commands_in_flight--;
+    if (list_empty(&relay_module->sent_commands))
+    {
+        relay_module_set_state(relay_module, RELAY_MODULE_STATE_IDLE);
+    }
+    else
+    {
+        relay_module_wait_for_command(relay_module);
+    }
+
+    relay_module_complete_command(relay_command, true, relay_module->response);
+
+    /* The response to the next command follows. */
+    relay_module->response_length = 0;
+    relay_module->response[0] = '\0';
+
+    relay_module_process_queue(relay_module);
+}
+
+static void relay_module_append_response(relay_module_st * const relay_module, char const ch)
+{
+    if (relay_module->response_length < sizeof relay_module->response - 1)
+    {
+        relay_module->response[relay_module->response_length] = ch;
+        relay_module->response_length++;
+        relay_module->response[relay_module->response_length] = '\0';
+    }
+}
+
+static bool relay_module_send_password(relay_module_st * const relay_module)
+{
+    bool sent_password;
+
+    if (dprintf(relay_module->fd.fd, "%s\r\n", relay_module->info->password) < 0)
+    {
+        sent_password = false;
+        goto done;
+    }
+
+    line_reader_init(&relay_module->line_reader);
+    relay_module_set_state(relay_module, RELAY_MODULE_STATE_WAIT_LOGIN_RESULT);
+    /* Back to waiting for the end of the login. */
+    relay_module_arm_timeout(relay_module, relay_module->deadline_msecs);
+
+    sent_password = true;
+
+done:
+    return sent_password;
+}
+
+static bool relay_module_process_char(relay_module_st * const relay_module, char const ch)
+{
+    bool session_ok;
+
+    switch (relay_module->state)
+    {
+        case RELAY_MODULE_STATE_WAIT_USERNAME_PROMPT:
+            if (prompt_matcher_feed(&relay_module->prompt_matcher, ch))
+            {
+                if (dprintf(relay_module->fd.fd, "%s\r\n", relay_module->info->username) < 0)
+                {
+                    session_ok = false;
+                    goto done;
+                }
+                relay_module_wait_for_prompt(relay_module, RELAY_MODULE_STATE_WAIT_PASSWORD_PROMPT, password_prompt);
+            }
+            break;
+
+        case RELAY_MODULE_STATE_WAIT_PASSWORD_PROMPT:
+            if (prompt_matcher_feed(&relay_module->prompt_matcher, ch))
+            {
+                /* For some reason the relay module chooses this point to
+                 * issue some telnet commands, and fails authentication if we
+                 * don't respond to it.
+                 */
+                uint64_t const telnet_deadline_msecs = monotonic_time_msecs() + TELNET_WAIT_MILLISECS;
+
+                relay_module_set_state(relay_module, RELAY_MODULE_STATE_WAIT_TELNET);
+                relay_module_arm_timeout(relay_module, 
+                                         (telnet_deadline_msecs < relay_module->deadline_msecs) 
+                                         ? telnet_deadline_msecs 
+                                         : relay_module->deadline_msecs);
+            }
+            break;
+
+        case RELAY_MODULE_STATE_WAIT_LOGIN_RESULT:
+            if (line_reader_feed(&relay_module->line_reader, ch))
+            {
+                char const * const line = relay_module->line_reader.line;
+
+                if (line_starts_with(line, login_success_string))
+                {
+                    relay_module_wait_for_prompt(relay_module, RELAY_MODULE_STATE_WAIT_LOGIN_PROMPT, command_prompt);
+                }
+                else if (line_starts_with(line, login_failure_string))
+                {
+                    DPRINTF("failed to log in to relay module %s\n", relay_module->info->address);
+                    session_ok = false;
+                    goto done;
+                }
+            }
+            break;
+
+        case RELAY_MODULE_STATE_WAIT_LOGIN_PROMPT:
+            if (prompt_matcher_feed(&relay_module->prompt_matcher, ch))
+            {
+                relay_module_set_state(relay_module, RELAY_MODULE_STATE_IDLE);
+                if (relay_module->connect_failures > 0)
+                {
+                    DPRINTF("relay module %s is reachable again\n", relay_module->info->address);
+                    relay_module->connect_failures = 0;
+                }
+                if (relay_module->session_cb != NULL)
+                {
+                    relay_module->session_cb(relay_module->user_context, true);
+                }
+                relay_module_process_queue(relay_module);
+            }
+            break;
+
+        case RELAY_MODULE_STATE_WAIT_COMMAND_PROMPT:
+            relay_module_append_response(relay_module, ch);
+            if (prompt_matcher_feed(&relay_module->prompt_matcher, ch))
+            {
+                relay_module_command_completed(relay_module);
+            }
+            break;
+
+        case RELAY_MODULE_STATE_DISCONNECTED:
+        case RELAY_MODULE_STATE_RESOLVING:
+        case RELAY_MODULE_STATE_CONNECTING:
+        case RELAY_MODULE_STATE_WAIT_TELNET:
+        case RELAY_MODULE_STATE_IDLE:
+            /* Nothing is expected from the module. Discard it. */
+            break;
+    }
+
+    session_ok = true;
+
+done:
+    return session_ok;
+}
+
+static bool relay_module_read_input(relay_module_st * const relay_module)
+{
+    bool session_ok;
+    unsigned int const disconnect_count = relay_module->disconnect_count;
+    telnet_reader_st * const reader = &relay_module->telnet_reader;
+
+    do
+    {
+        ssize_t const read_result = telnet_reader_read(reader, relay_module->fd.fd);
+        bool const no_more_data = 
+            read_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        ssize_t index;
+
+        if (read_result == 0)
+        {
+            /* The module closed the connection. */
+            session_ok = false;
+            goto done;
+        }
+        if (read_result < 0 && !no_more_data)
+        {
+            session_ok = false;
+            goto done;
+        }
+
+        for (index = 0; index < read_result; index++)
+        {
+            if (!relay_module_process_char(relay_module, reader->buffer[index]))
+            {
+                session_ok = false;
+                goto done;
+            }
+            if (relay_module->disconnect_count != disconnect_count)
+            {
+                /* The session was torn down, and has already been
+                 * dealt with, while processing the input.
+                 */
+                session_ok = true;
+                goto done;
+            }
+        }
+
+        if (relay_module->state == RELAY_MODULE_STATE_WAIT_TELNET 
+            && reader->commands_handled > 0)
+        {
+            if (!relay_module_send_password(relay_module))
+            {
+                session_ok = false;
+                goto done;
+            }
+        }
+
+        if (no_more_data)
+        {
+            session_ok = true;
+            goto done;
+        }
+    }
+    while (1);
+
+done:
+    return session_ok;
+}
+
+static void relay_module_connected(relay_module_st * const relay_module)
+{
+    telnet_reader_init(&relay_module->telnet_reader);
+    uloop_fd_add(&relay_module->fd, ULOOP_READ);
+    relay_module_start_operation(relay_module, relay_module->settings.login_millisecs);
+    relay_module_wait_for_prompt(relay_module, RELAY_MODULE_STATE_WAIT_USERNAME_PROMPT, username_prompt);
+}
+
+static void relay_module_fd_handler(struct uloop_fd * const fd, unsigned int const events)
+{
+    relay_module_st * const relay_module = container_of(fd, relay_module_st, fd);
+
+    if (relay_module->state == RELAY_MODULE_STATE_CONNECTING)
+    {
+        if (socket_connect_result(fd->fd) != 0)
+        {
+            /* Try the module's other addresses, if it has any. */
+            uloop_fd_delete(fd);
+            close(fd->fd);
+            fd->fd = -1;
+            relay_module_connect_next_address(relay_module);
+            goto done;
+        }
+        relay_module_connected(relay_module);
+        goto done;
+    }
+
+    if (!relay_module_read_input(relay_module))
+    {
+        relay_module_session_failed(relay_module);
+        goto done;
+    }
+
+done:
+    return;
+}
+
+static void relay_module_timeout_handler(struct uloop_timeout * const timeout)
+{
+    relay_module_st * const relay_module = container_of(timeout, relay_module_st, timeout);
+
+    if (relay_module->state == RELAY_MODULE_STATE_WAIT_TELNET
+        && monotonic_time_msecs() < relay_module->deadline_msecs)
+    {
+        /* The module didn't send any telnet commands. Carry on
+         * anyway.
+         */
+        if (!relay_module_send_password(relay_module))
+        {
+            relay_module_session_failed(relay_module);
+        }
+        goto done;
+    }
+
+    DPRINTF("timed out waiting for relay module %s\n", relay_module->info->address);
+    relay_module_session_failed(relay_module);
+
+done:
+    return;
+}
+
+static void relay_module_connect_next_address(relay_module_st * const relay_module)
+{
+    while (relay_module->next_address != NULL)
+    {
+        struct addrinfo const * const address = relay_module->next_address;
+        bool in_progress;
+        int sock_fd;
+
+        relay_module->next_address = address->ai_next;
+
+        sock_fd = connect_to_address(address, &in_progress);
+        if (sock_fd < 0)
+        {
+            continue;
+        }
+
+        relay_module->fd.fd = sock_fd;
+        relay_module->fd.eof = false;
+        relay_module->fd.error = false;
+
+        if (in_progress)
+        {
+            uloop_fd_add(&relay_module->fd, ULOOP_WRITE);
+            relay_module_set_state(relay_module, RELAY_MODULE_STATE_CONNECTING);
+        }
+        else
+        {
+            relay_module_connected(relay_module);
+        }
+        goto done;
+    }
+
+    DPRINTF("failed to connect to relay module %s\n", relay_module->info->address);
+    relay_module_session_failed(relay_module);
+
+done:
+    return;
+}
+
+static void relay_module_connect_to_addresses(relay_module_st * const relay_module)
+{
+    relay_module->next_address = relay_module->addresses;
+    relay_module_connect_next_address(relay_module);
+}
+
+static void relay_module_address_resolved(void * const user_context, struct addrinfo * const addresses)
+{
+    relay_module_st * const relay_module = user_context;
+
+    relay_module->resolver = NULL;
+
+    if (addresses == NULL)
+    {
+        /* Keep using the previous addresses, if there were any. */
+        DPRINTF("failed to resolve relay module %s\n", relay_module->info->address);
+    }
+    else
+    {
+        if (relay_module->addresses != NULL)
+        {
+            freeaddrinfo(relay_module->addresses);
+        }
+        relay_module->addresses = addresses;
+    }
+
+    if (relay_module->state == RELAY_MODULE_STATE_RESOLVING)
+    {
+        /* A connection was waiting for the addresses. */
+        relay_module_connect_to_addresses(relay_module);
+    }
+}
+
+/* Starts resolving the module's address in the background, unless it 
+ * is already being resolved. Returns false if it couldn't be started. 
+ */
+static bool relay_module_resolve_address(relay_module_st * const relay_module)
+{
+    bool resolving;
+
+    if (relay_module->resolver != NULL)
+    {
+        resolving = true;
+        goto done;
+    }
+
+    relay_module->resolver = address_resolver_start(relay_module->info->address, 
+                                                    relay_module->info->port, 
+                                                    relay_module_address_resolved, 
+                                                    relay_module);
+    resolving = relay_module->resolver != NULL;
+
+done:
+    return resolving;
+}
+
+static void relay_module_adjust_idle_period(relay_module_st * const relay_module)
+{
+    unsigned int const maximum_idle_millisecs = 
+        relay_module->settings.idle_millisecs * MAXIMUM_IDLE_MULTIPLIER;
+
+    if (relay_module->idle_closed_msecs == 0)
+    {
+        goto done;
+    }
+
+    if (monotonic_time_msecs() - relay_module->idle_closed_msecs < relay_module->idle_millisecs)
+    {
+        /* Closed too soon. */
+        relay_module->idle_millisecs *= 2;
+        if (relay_module->idle_millisecs > maximum_idle_millisecs)
+        {
+            relay_module->idle_millisecs = maximum_idle_millisecs;
+        }
+    }
+    else
+    {
+        relay_module->idle_millisecs = relay_module->settings.idle_millisecs;
+    }
+    relay_module->idle_closed_msecs = 0;
+
+done:
+    return;
+}
+
+/* With resolve_first, the connection waits for the address to be 
+ * resolved again, in case it has changed. 
+ */
+static void relay_module_connect(relay_module_st * const relay_module, bool const resolve_first)
+{
+    uloop_timeout_cancel(&relay_module->reconnect_timer);
+    relay_module_adjust_idle_period(relay_module);
+
+    /* All of the addresses share the one deadline, which includes 
+     * any time spent resolving them. 
+     */
+    relay_module_start_operation(relay_module, relay_module->settings.connect_millisecs);
+
+    /* The address is normally resolved before any requests arrive, 
+     * so that requests don't have to wait for it. 
+     */
+    if (resolve_first || relay_module->addresses == NULL)
+    {
+        relay_module_set_state(relay_module, RELAY_MODULE_STATE_RESOLVING);
+        if (!relay_module_resolve_address(relay_module))
+        {
+            /* Fall back to the previous addresses, if there are any. */
+            relay_module_connect_to_addresses(relay_module);
+        }
+        goto done;
+    }
+
+    relay_module_connect_to_addresses(relay_module);
 
-static bool relay_module_login(int const sock_fd, char const * const username, char const * const password)
+done:
+    return;
+}
+
+static void relay_module_reconnect_timeout_handler(struct uloop_timeout * const timeout)
+{
+    relay_module_st * const relay_module = container_of(timeout, relay_module_st, reconnect_timer);
+
+    if (relay_module->state == RELAY_MODULE_STATE_DISCONNECTED)
+    {
+        /* The module's address may have changed. */
+        relay_module_connect(relay_module, true);
+    }
+}
+
+static void relay_module_process_queue(relay_module_st * const relay_module)
+{
+    if (relay_module_next_queued_command(relay_module) == NULL)
+    {
+        if (relay_module->state == RELAY_MODULE_STATE_IDLE
+            && relay_module->settings.session_mode != RELAY_MODULE_SESSION_PERSISTENT
+            && relay_module->settings.idle_millisecs > 0)
+        {
+            uloop_timeout_set(&relay_module->idle_timer, relay_module->idle_millisecs);
+        }
+        goto done;
+    }
+
+    switch (relay_module->state)
+    {
+        case RELAY_MODULE_STATE_DISCONNECTED:
+            relay_module_connect(relay_module, false);
+            break;
+
+        case RELAY_MODULE_STATE_IDLE:
+        case RELAY_MODULE_STATE_WAIT_COMMAND_PROMPT:
+            relay_module_send_queued_commands(relay_module);
+            break;
+
+        default:
+            /* Busy. The queue is serviced again once the current
+             * operation completes.
+             */
+            break;
+    }
+
+done:
+    return;
+}
+
+/* Returns NULL if the command is too long for the module. */
+static relay_module_command_st * relay_module_command_create(char const * const command)
 {
-    bool logged_in;
+    relay_module_command_st * relay_command = NULL;
 
-    if (!wait_for_prompt(sock_fd, "User Name: ", PROMPT_WAIT_SECONDS))
+    if (strlen(command) >= sizeof relay_command->command)
     {
-        logged_in = false;
         goto done;
     }
-    if (dprintf(sock_fd, "%s\r\n", username) < 0)
+
+    relay_command = calloc(1, sizeof *relay_command);
+    if (relay_command == NULL)
     {
-        logged_in = false;
         goto done;
     }
-    if (!wait_for_prompt(sock_fd, "Password: ", PROMPT_WAIT_SECONDS))
+
+    strcpy(relay_command->command, command);
+    INIT_LIST_HEAD(&relay_command->superseded_writes);
+
+done:
+    return relay_command;
+}
+
+/* Takes ownership of relay_command, which is freed if it can't be 
+ * queued. 
+ */
+static bool relay_module_queue_command(relay_module_st * const relay_module,
+                                       relay_module_priority_t const priority,
+                                       relay_module_command_st * const relay_command)
+{
+    bool submitted;
+    relay_module_priority_t queue_priority = priority;
+
+    if (relay_module_circuit_is_open(relay_module))
     {
-        logged_in = false;
+        /* Fail fast. Only the background retry tries to connect 
+         * until the module is reachable again. 
+         */
+        free(relay_command);
+        submitted = false;
         goto done;
     }
 
-    /* For some reason the relay module chooses this point to 
-     * issue some telnet commands, and fails authentication if we 
-     * don't respond to it. 
+    if (relay_command->is_write)
+    {
+        queue_priority = relay_module_supersede_queued_writes(relay_module, relay_command, priority);
+    }
+    list_add_tail(&relay_command->list, &relay_module->queued_commands[queue_priority]);
+
+    /* Note that the command may complete (or fail) before this
+     * function returns.
      */
-    if (!wait_for_telnet(sock_fd))
+    relay_module_process_queue(relay_module);
+
+    submitted = true;
+
+done:
+    return submitted;
+}
+
+bool relay_module_submit_command(relay_module_st * const relay_module,
+                                 relay_module_priority_t const priority,
+                                 char const * const command,
+                                 relay_module_command_done_fn const done_cb,
+                                 void * const user_context)
+{
+    bool submitted;
+    relay_module_command_st * const relay_command = relay_module_command_create(command);
+
+    if (relay_command == NULL)
     {
-        logged_in = false;
+        submitted = false;
         goto done;
     }
 
-    if (dprintf(sock_fd, "%s\r\n", password) < 0)
+    relay_command->done_cb = done_cb;
+    relay_command->user_context = user_context;
+
+    submitted = relay_module_queue_command(relay_module, priority, relay_command);
+
+done:
+    return submitted;
+}
+
+/* The module echoes the command back before the value it returns,
+ * and uses "\n\r" as the line terminator.
+ */
+static bool relay_module_response_value(char const * const response,
+                                        char const * const command,
+                                        char * const value,
+                                        size_t const value_size)
+{
+    bool found_value;
+    char const * line = response;
+
+    while (*line != '\0')
+    {
+        size_t const line_length = strcspn(line, "\r\n");
+
+        if (line_length > 0
+            && !(line_length == strlen(command) && strncmp(line, command, line_length) == 0))
+        {
+            if (line_length >= value_size)
+            {
+                found_value = false;
+                goto done;
+            }
+            memcpy(value, line, line_length);
+            value[line_length] = '\0';
+            found_value = true;
+            goto done;
+        }
+        line += line_length;
+        line += strspn(line, "\r\n");
+    }
+
+    found_value = false;
+
+done:
+    return found_value;
+}
+
+static void relay_module_read_relay_states_done(void * const user_context,
+                                                bool const success,
+                                                char const * const response)
+{
+    relay_module_read_st * const read = user_context;
+    char value[MAX_RESPONSE_LENGTH];
+    char * end;
+    unsigned long long states_bitmask = 0;
+    bool read_states;
+
+    if (!success || !relay_module_response_value(response, read->command, value, sizeof value))
     {
-        logged_in = false;
+        read_states = false;
         goto done;
     }
 
-    if (!read_until_string_found(sock_fd, "Logged in successfully", "Access denied"))
+    states_bitmask = strtoull(value, &end, 16);
+    read_states = *end == '\0';
+
+done:
+    read->done_cb(read->user_context, read_states, states_bitmask);
+    free(read);
+}
+
+bool relay_module_read_relay_states(relay_module_st * const relay_module,
+                                    relay_module_priority_t const priority,
+                                    relay_module_read_done_fn const done_cb,
+                                    void * const user_context)
+{
+    bool submitted;
+    relay_module_read_st * const read = calloc(1, sizeof *read);
+
+    if (read == NULL)
     {
-        logged_in = false;
+        submitted = false;
         goto done;
     }
 
-    if (!wait_for_prompt(sock_fd, ">", PROMPT_WAIT_SECONDS))
+    snprintf(read->command, sizeof read->command, "relay readall");
+    read->done_cb = done_cb;
+    read->user_context = user_context;
+
+    submitted = relay_module_submit_command(relay_module,
+                                            priority,
+                                            read->command,
+                                            relay_module_read_relay_states_done,
+                                            read);
+    if (!submitted)
+    {
+        free(read);
+    }
+
+done:
+    return submitted;
+}
+
+bool update_relay_module(relay_module_st * const relay_module,
+                         relay_module_priority_t const priority,
+                         uint64_t const writeall_bitmask,
+                         relay_module_write_done_fn const done_cb,
+                         void * const user_context)
+{
+    bool submitted;
+    char command[MAX_COMMAND_LENGTH];
+    relay_module_command_st * relay_command;
+
+    /* The module expects a digit for every four relays it has. */
+    snprintf(command, sizeof command, "relay writeall %0*" PRIx64, 
+             relay_module->writeall_digits, writeall_bitmask);
+
+    relay_command = relay_module_command_create(command);
+    if (relay_command == NULL)
     {
-        logged_in = false;
+        submitted = false;
         goto done;
     }
 
-    logged_in = true;
+    relay_command->is_write = true;
+    relay_command->write_done_cb = done_cb;
+    relay_command->user_context = user_context;
+
+    submitted = relay_module_queue_command(relay_module, priority, relay_command);
 
 done:
+    return submitted;
+}
 
-    return logged_in;
+static void relay_module_verified_write_release(relay_module_verified_write_st * const verified_write)
+{
+    verified_write->pending--;
+    if (verified_write->pending == 0)
+    {
+        verified_write->done_cb(verified_write->user_context,
+                                verified_write->wrote_states && verified_write->read_states,
+                                verified_write->states_bitmask);
+        free(verified_write);
+    }
+}
+
+static void relay_module_verified_write_done(void * const user_context,
+                                             bool const success,
+                                             bool const superseded)
+{
+    relay_module_verified_write_st * const verified_write = user_context;
+
+    verified_write->wrote_states = success;
+    relay_module_verified_write_release(verified_write);
+}
+
+static void relay_module_verified_read_done(void * const user_context,
+                                            bool const success,
+                                            uint64_t const states_bitmask)
+{
+    relay_module_verified_write_st * const verified_write = user_context;
+
+    verified_write->read_states = success;
+    verified_write->states_bitmask = states_bitmask;
+    relay_module_verified_write_release(verified_write);
 }
 
-static bool relay_module_set_all_relay_states(int const sock_fd, unsigned int const writeall_bitmask)
+bool update_relay_module_verified(relay_module_st * const relay_module,
+                                  relay_module_priority_t const priority,
+                                  uint64_t const writeall_bitmask,
+                                  relay_module_read_done_fn const done_cb,
+                                  void * const user_context)
 {
-    bool set_states;
+    bool submitted;
+    relay_module_verified_write_st * const verified_write = calloc(1, sizeof *verified_write);
 
-    if (dprintf(sock_fd, "relay writeall %02x\r\n", writeall_bitmask) < 0)
+    if (verified_write == NULL)
     {
-        set_states = false;
+        submitted = false;
         goto done;
     }
-    if (!wait_for_prompt(sock_fd, ">", PROMPT_WAIT_SECONDS))
+
+    verified_write->done_cb = done_cb;
+    verified_write->user_context = user_context;
+    /* Held until both commands have been submitted, in case either 
+     * completes straight away. 
+     */
+    verified_write->pending = 1;
+
+    verified_write->pending++;
+    if (!update_relay_module(relay_module, priority, writeall_bitmask, relay_module_verified_write_done, verified_write))
     {
-        set_states = false;
+        free(verified_write);
+        submitted = false;
         goto done;
     }
-    set_states = true;
+
+    /* The readall follows the writeall down the pipeline, so the 
+     * check doesn't cost another round trip. 
+     */
+    verified_write->pending++;
+    if (!relay_module_read_relay_states(relay_module, priority, relay_module_verified_read_done, verified_write))
+    {
+        verified_write->pending--;
+    }
+
+    relay_module_verified_write_release(verified_write);
+    submitted = true;
 
 done:
-    return set_states;
+    return submitted;
+}
+
+/* The module numbers its channels 0-9 and then A-V. */
+static char relay_module_channel_digit(unsigned int const channel)
+{
+    return (channel < 10) ? '0' + channel : 'A' + (channel - 10);
+}
+
+static void relay_module_gpio_read_release(relay_module_gpio_read_st * const gpio_read)
+{
+    gpio_read->pending--;
+    if (gpio_read->pending == 0)
+    {
+        gpio_read->done_cb(gpio_read->user_context,
+                           gpio_read->read_states,
+                           gpio_read->states_bitmask);
+        free(gpio_read);
+    }
+}
+
+static void relay_module_gpio_line_read_done(void * const user_context,
+                                             bool const success,
+                                             char const * const response)
+{
+    relay_module_gpio_line_read_st * const line_read = user_context;
+    relay_module_gpio_read_st * const gpio_read = line_read->gpio_read;
+    char value[MAX_RESPONSE_LENGTH];
+
+    if (!success || !relay_module_response_value(response, line_read->command, value, sizeof value))
+    {
+        gpio_read->read_states = false;
+    }
+    else if (strcmp(value, "on") == 0)
+    {
+        gpio_read->states_bitmask |= (uint64_t)1 << line_read->gpio;
+    }
+    else if (strcmp(value, "off") != 0)
+    {
+        gpio_read->read_states = false;
+    }
+
+    free(line_read);
+    relay_module_gpio_read_release(gpio_read);
 }
 
-#if defined NEED_SET_RELAY_STATE
-static bool relay_module_set_relay_state(int const sock_fd, unsigned int const relay, bool const state)
+bool relay_module_read_gpios(relay_module_st * const relay_module,
+                             relay_module_priority_t const priority,
+                             unsigned int const gpio_bitmask,
+                             relay_module_read_done_fn const done_cb,
+                             void * const user_context)
 {
-    bool set_state;
+    bool submitted;
+    unsigned int gpio;
+    relay_module_gpio_read_st * const gpio_read = calloc(1, sizeof *gpio_read);
 
-    if (dprintf(sock_fd, "relay %s %u\r\n", state ? "on" : "off", relay) < 0)
+    if (gpio_read == NULL)
     {
-        set_state = false;
+        submitted = false;
         goto done;
     }
-    if (!wait_for_prompt(sock_fd, ">", PROMPT_WAIT_SECONDS))
+
+    gpio_read->read_states = true;
+    gpio_read->done_cb = done_cb;
+    gpio_read->user_context = user_context;
+    /* Held until all of the reads have been submitted, in case any 
+     * of them completes straight away. 
+     */
+    gpio_read->pending = 1;
+
+    for (gpio = 0; gpio < sizeof gpio_bitmask * 8; gpio++)
+    {
+        relay_module_gpio_line_read_st * line_read;
+
+        if ((gpio_bitmask & (1U << gpio)) == 0)
+        {
+            continue;
+        }
+
+        line_read = calloc(1, sizeof *line_read);
+        if (line_read == NULL)
+        {
+            gpio_read->read_states = false;
+            break;
+        }
+        snprintf(line_read->command, sizeof line_read->command, 
+                 "gpio read %c", relay_module_channel_digit(gpio));
+        line_read->gpio = gpio;
+        line_read->gpio_read = gpio_read;
+
+        gpio_read->pending++;
+        if (!relay_module_submit_command(relay_module,
+                                         priority,
+                                         line_read->command,
+                                         relay_module_gpio_line_read_done,
+                                         line_read))
+        {
+            gpio_read->pending--;
+            gpio_read->read_states = false;
+            free(line_read);
+            break;
+        }
+    }
+
+    if (gpio_read->pending == 1 && !gpio_read->read_states)
     {
-        set_state = false;
+        /* Nothing was submitted. */
+        free(gpio_read);
+        submitted = false;
         goto done;
     }
-    set_state = true;
+
+    relay_module_gpio_read_release(gpio_read);
+    submitted = true;
 
 done:
-    return set_state;
+    return submitted;
+}
+
+bool relay_module_write_gpio(relay_module_st * const relay_module,
+                             relay_module_priority_t const priority,
+                             unsigned int const gpio,
+                             bool const state,
+                             relay_module_command_done_fn const done_cb,
+                             void * const user_context)
+{
+    char command[MAX_COMMAND_LENGTH];
+
+    snprintf(command, sizeof command, "gpio %s %c", 
+             state ? "set" : "clear", relay_module_channel_digit(gpio));
+
+    return relay_module_submit_command(relay_module, priority, command, done_cb, user_context);
 }
-#endif
 
-static int relay_module_connect(char const * const address,
-                                int16_t const port,
-                                char const * const username,
-                                char const * const password)
+static void relay_module_read_adc_done(void * const user_context,
+                                       bool const success,
+                                       char const * const response)
 {
-    int sock_fd;
+    relay_module_adc_read_st * const read = user_context;
+    char value[MAX_RESPONSE_LENGTH];
+    char * end;
+    unsigned long adc_value = 0;
+    bool read_value;
 
-    sock_fd = connect_to_socket(address, port);
-    if (sock_fd < 0)
+    if (!success || !relay_module_response_value(response, read->command, value, sizeof value))
     {
+        read_value = false;
         goto done;
     }
 
-    if (!relay_module_login(sock_fd, username, password))
+    adc_value = strtoul(value, &end, 10);
+    read_value = end != value && *end == '\0';
+
+done:
+    read->done_cb(read->user_context, read_value, adc_value);
+    free(read);
+}
+
+bool relay_module_read_adc(relay_module_st * const relay_module,
+                           relay_module_priority_t const priority,
+                           unsigned int const channel,
+                           relay_module_adc_read_done_fn const done_cb,
+                           void * const user_context)
+{
+    bool submitted;
+    relay_module_adc_read_st * const read = calloc(1, sizeof *read);
+
+    if (read == NULL)
     {
-        close(sock_fd);
-        sock_fd = -1;
+        submitted = false;
         goto done;
     }
 
+    snprintf(read->command, sizeof read->command, "adc read %c", relay_module_channel_digit(channel));
+    read->done_cb = done_cb;
+    read->user_context = user_context;
+
+    submitted = relay_module_submit_command(relay_module,
+                                            priority,
+                                            read->command,
+                                            relay_module_read_adc_done,
+                                            read);
+    if (!submitted)
+    {
+        free(read);
+    }
+
 done:
-    return sock_fd;
+    return submitted;
 }
 
-void relay_module_disconnect(int const relay_module_fd)
+static void relay_module_idle_timeout_handler(struct uloop_timeout * const timeout)
 {
-    if (relay_module_fd >= 0)
+    relay_module_st * const relay_module = container_of(timeout, relay_module_st, idle_timer);
+
+    if (relay_module->state != RELAY_MODULE_STATE_IDLE)
+    {
+        goto done;
+    }
+
+    if (relay_module->settings.session_mode == RELAY_MODULE_SESSION_KEEPALIVE)
+    {
+        /* A cheap command that finds a dead session before a 
+         * request does. The idle timer is started again once it 
+         * has completed. 
+         */
+        relay_module_submit_command(relay_module, RELAY_MODULE_PRIORITY_TELEMETRY, keepalive_command, NULL, NULL);
+    }
+    else
     {
-        close(relay_module_fd);
+        relay_module_disconnect(relay_module);
+        relay_module->idle_closed_msecs = monotonic_time_msecs();
     }
+
+done:
+    return;
 }
 
-bool update_relay_module(unsigned int const writeall_bitmask,
-                         relay_module_info_st const * const relay_module_info,
-                         int * const relay_fd)
+bool relay_module_session_mode_from_string(char const * const string, 
+                                           relay_module_session_mode_t * const session_mode)
 {
-    bool updated_states;
+    bool found_mode;
+    size_t index;
 
-    if (*relay_fd == -1)
+    for (index = 0; index < ARRAY_SIZE(session_mode_strings); index++)
     {
-        *relay_fd = relay_module_connect(relay_module_info->address,
-                                         relay_module_info->port,
-                                         relay_module_info->username,
-                                         relay_module_info->password);
-        if (*relay_fd == -1)
+        if (strcmp(string, session_mode_strings[index]) == 0)
         {
-            updated_states = false;
+            *session_mode = index;
+            found_mode = true;
             goto done;
         }
     }
-    if (!relay_module_set_all_relay_states(*relay_fd, writeall_bitmask))
+
+    found_mode = false;
+
+done:
+    return found_mode;
+}
+
+void relay_module_start(relay_module_st * const relay_module)
+{
+    /* Idle sessions are meant to be closed, so there is no point 
+     * re-establishing one that is lost. 
+     */
+    relay_module->keep_connected = 
+        relay_module->settings.session_mode != RELAY_MODULE_SESSION_IDLE_CLOSE;
+    if (relay_module->state == RELAY_MODULE_STATE_DISCONNECTED)
+    {
+        relay_module_connect(relay_module, false);
+    }
+    else
+    {
+        relay_module_resolve_address(relay_module);
+    }
+}
+
+relay_module_st * relay_module_create(relay_module_info_st const * const relay_module_info,
+                                      relay_module_settings_st const * const settings,
+                                      relay_module_session_fn const session_cb,
+                                      void * const user_context)
+{
+    numato_model_st const * const model = numato_model_find(settings->num_relays);
+    relay_module_st * relay_module;
+    relay_module_priority_t priority;
+
+    if (model == NULL)
+    {
+        DPRINTF("no module has %u relays\n", settings->num_relays);
+        relay_module = NULL;
+        goto done;
+    }
+
+    relay_module = calloc(1, sizeof *relay_module);
+    if (relay_module == NULL)
     {
-        relay_module_disconnect(*relay_fd);
-        *relay_fd = -1;
-        updated_states = false;
         goto done;
     }
 
-    updated_states = true;
+    relay_module->info = relay_module_info;
+    relay_module->writeall_digits = model->writeall_digits;
+    relay_module->settings = *settings;
+    relay_module->session_cb = session_cb;
+    relay_module->user_context = user_context;
+    relay_module->reconnect_timer.cb = relay_module_reconnect_timeout_handler;
+    relay_module->idle_timer.cb = relay_module_idle_timeout_handler;
+    relay_module->idle_millisecs = settings->idle_millisecs;
+    relay_module->state = RELAY_MODULE_STATE_DISCONNECTED;
+    relay_module->fd.fd = -1;
+    relay_module->fd.cb = relay_module_fd_handler;
+    relay_module->timeout.cb = relay_module_timeout_handler;
+    for (priority = 0; priority < RELAY_MODULE_PRIORITY_COUNT; priority++)
+    {
+        INIT_LIST_HEAD(&relay_module->queued_commands[priority]);
+    }
+    INIT_LIST_HEAD(&relay_module->sent_commands);
 
 done:
-    return updated_states;
+    return relay_module;
 }
 
+void relay_module_free(relay_module_st * const relay_module)
+{
+    LIST_HEAD(failed_commands);
+
+    if (relay_module == NULL)
+    {
+        goto done;
+    }
+
+    relay_module->keep_connected = false;
+    /* The user is going away, so isn't told that the session has 
+     * ended. 
+     */
+    relay_module->session_cb = NULL;
+    uloop_timeout_cancel(&relay_module->reconnect_timer);
+    uloop_timeout_cancel(&relay_module->idle_timer);
+    address_resolver_cancel(relay_module->resolver);
+    relay_module_disconnect(relay_module);
+    relay_module_fail_commands(&relay_module->sent_commands);
+    relay_module->commands_in_flight = 0;
+    relay_module_splice_queued_commands(relay_module, &failed_commands);
+    relay_module_fail_commands(&failed_commands);
+
+    if (relay_module->addresses != NULL)
+    {
+        freeaddrinfo(relay_module->addresses);
+    }
+    free(relay_module);
+
+done:
+    return;
+}
 
@@ -4,17 +4,151 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define TELNET_PORT 23
+
 typedef struct relay_module_info_st
 {
     char const * address;
     uint16_t port;
     char const * username;
     char const * password;
-} relay_module_info_st; 
+} relay_module_info_st;
+
+/* What to do with the session once the module has been idle for 
+ * a while. Closing it frees the module's single telnet session for 
+ * other users, at the cost of logging in again for the next command. 
+ */
+typedef enum relay_module_session_mode_t
+{
+    RELAY_MODULE_SESSION_PERSISTENT, /* Leave it open. */
+    RELAY_MODULE_SESSION_KEEPALIVE, /* Leave it open, and check that the module is still there. */
+    RELAY_MODULE_SESSION_IDLE_CLOSE /* Close it. */
+} relay_module_session_mode_t;
+
+/* How the session is managed once the module has been idle for 
+ * idle_millisecs, and the time allowed to connect and log in to 
+ * the module, and for the module to respond to each command. 
+ */
+typedef struct relay_module_settings_st
+{
+    relay_module_session_mode_t session_mode;
+    unsigned int idle_millisecs;
+    unsigned int connect_millisecs;
+    unsigned int login_millisecs;
+    unsigned int command_millisecs;
+    unsigned int pipeline_depth; /* The most commands to send before waiting for a response. */
+    unsigned int num_relays; /* Must match one of the supported models. */
+} relay_module_settings_st;
+
+bool relay_module_session_mode_from_string(char const * const string, 
+                                           relay_module_session_mode_t * const session_mode);
+
+typedef struct relay_module_st relay_module_st;
+
+/* Queued commands are sent in priority order, and in the order 
+ * they were submitted within each priority. 
+ */
+typedef enum relay_module_priority_t
+{
+    RELAY_MODULE_PRIORITY_EMERGENCY,
+    RELAY_MODULE_PRIORITY_USER,
+    RELAY_MODULE_PRIORITY_RECONCILE,
+    RELAY_MODULE_PRIORITY_TELEMETRY,
+    RELAY_MODULE_PRIORITY_COUNT
+} relay_module_priority_t;
+
+/* Called once a submitted command has completed. response
+ * contains the text the module sent back before the prompt, and
+ * is only valid for the duration of the call.
+ */
+typedef void (* relay_module_command_done_fn)(void * const user_context,
+                                              bool const success,
+                                              char const * const response);
+
+/* Called once a write has completed. superseded is set if a newer 
+ * write replaced this one before it was sent, so these states never 
+ * reached the module. success is then the result of the newer write. 
+ */
+typedef void (* relay_module_write_done_fn)(void * const user_context,
+                                            bool const success,
+                                            bool const superseded);
+
+typedef void (* relay_module_read_done_fn)(void * const user_context,
+                                           bool const success,
+                                           uint64_t const states_bitmask);
+
+/* Called with the value read from an ADC input, from 0 to 1023. */
+typedef void (* relay_module_adc_read_done_fn)(void * const user_context,
+                                               bool const success,
+                                               unsigned int const value);
+
+/* Called each time a session with the module has been
+ * established, and each time an established session ends.
+ */
+typedef void (* relay_module_session_fn)(void * const user_context, bool const established);
+
+relay_module_st * relay_module_create(relay_module_info_st const * const relay_module_info,
+                                      relay_module_settings_st const * const settings,
+                                      relay_module_session_fn const session_cb,
+                                      void * const user_context);
+void relay_module_free(relay_module_st * const relay_module);
+
+/* Logs in to the module straight away, rather than waiting for the
+ * first command, and keeps the session established from then on.
+ */
+void relay_module_start(relay_module_st * const relay_module);
+
+bool relay_module_submit_command(relay_module_st * const relay_module,
+                                 relay_module_priority_t const priority,
+                                 char const * const command,
+                                 relay_module_command_done_fn const done_cb,
+                                 void * const user_context);
+
+/* Any older write that hasn't been sent yet is dropped, and 
+ * completes as superseded with the result of this one. 
+ */
+bool update_relay_module(relay_module_st * const relay_module,
+                         relay_module_priority_t const priority,
+                         uint64_t const writeall_bitmask,
+                         relay_module_write_done_fn const done_cb,
+                         void * const user_context);
+
+/* Writes the states and reads them back from the module. done_cb 
+ * is given the states that were read. 
+ */
+bool update_relay_module_verified(relay_module_st * const relay_module,
+                                  relay_module_priority_t const priority,
+                                  uint64_t const writeall_bitmask,
+                                  relay_module_read_done_fn const done_cb,
+                                  void * const user_context);
+
+bool relay_module_read_relay_states(relay_module_st * const relay_module,
+                                    relay_module_priority_t const priority,
+                                    relay_module_read_done_fn const done_cb,
+                                    void * const user_context);
+
+/* Reads each of the GPIO lines in gpio_bitmask. The reads are 
+ * submitted together, so they are sent down the pipeline as one 
+ * burst. done_cb is given the states of the lines, with bit n set 
+ * if GPIO n is high. 
+ */
+bool relay_module_read_gpios(relay_module_st * const relay_module,
+                             relay_module_priority_t const priority,
+                             unsigned int const gpio_bitmask,
+                             relay_module_read_done_fn const done_cb,
+                             void * const user_context);
+
+bool relay_module_write_gpio(relay_module_st * const relay_module,
+                             relay_module_priority_t const priority,
+                             unsigned int const gpio,
+                             bool const state,
+                             relay_module_command_done_fn const done_cb,
+                             void * const user_context);
 
-void relay_module_disconnect(int const relay_module_fd);
-bool update_relay_module(unsigned int const writeall_bitmask,
-                         relay_module_info_st const * const relay_module_info,
-                         int * const relay_fd);
+bool relay_module_read_adc(relay_module_st * const relay_module,
+                           relay_module_priority_t const priority,
+                           unsigned int const channel,
+                           relay_module_adc_read_done_fn const done_cb,
+                           void * const user_context);
 
 #endif /* __RELAY_MODULE_H__ */
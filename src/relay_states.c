@@ -1,16 +1,26 @@
 #include "relay_states.h"
 
+#include <libubox/utils.h>
+
 #include <stddef.h>
 #include <stdlib.h>
 
-#define BIT(x) (1UL << (x))
+#define BIT(x) ((uint64_t)1 << (x))
 
 struct relay_states_st
 {
-    unsigned int states_modified; /* Bitmask indicating which bits in desired_states have meaning. */
-    unsigned int desired_states; /* Bitmask of the desired states. */
+    uint64_t states_modified; /* Bitmask indicating which bits in desired_states have meaning. */
+    uint64_t desired_states; /* Bitmask of the desired states. */
 }; 
 
+static numato_model_st const numato_models[] =
+{
+    { .num_relays = 8, .writeall_digits = 2 },
+    { .num_relays = 16, .writeall_digits = 4 },
+    { .num_relays = 32, .writeall_digits = 8 },
+    { .num_relays = 64, .writeall_digits = 16 }
+};
+
 void relay_states_init(relay_states_st * const relay_states)
 {
     if (relay_states == NULL)
@@ -45,8 +55,16 @@ void relay_states_free(relay_states_st * const relay_states)
     free(relay_states);
 }
 
-void relay_states_set_state(relay_states_st * const relay_states, unsigned int relay_index, bool const state)
+bool relay_states_set_state(relay_states_st * const relay_states, unsigned int relay_index, bool const state)
 {
+    bool set_state;
+
+    if (relay_index >= NUMATO_MAX_RELAYS)
+    {
+        set_state = false;
+        goto done;
+    }
+
     relay_states->states_modified |= BIT(relay_index);
     if (state)
     {
@@ -56,6 +74,17 @@ void relay_states_set_state(relay_states_st * const relay_states, unsigned int r
     {
         relay_states->desired_states &= ~BIT(relay_index);
     }
+    set_state = true;
+
+done:
+    return set_state;
+}
+
+void relay_states_set_states(relay_states_st * const relay_states, uint64_t const mask, uint64_t const states)
+{
+    relay_states->states_modified |= mask;
+    relay_states->desired_states &= ~mask;
+    relay_states->desired_states |= states & mask;
 }
 
 relay_states_st * relay_states_combine(relay_states_st const * const previous_relay_states,
@@ -84,17 +113,33 @@ done:
     return combined_relay_states;
 }
 
-unsigned int relay_states_get_states_bitmask(relay_states_st const * const relay_states)
+uint64_t relay_states_get_states_bitmask(relay_states_st const * const relay_states)
 {
     return relay_states->desired_states;
 }
 
-size_t numato_num_inputs(void)
+numato_model_st const * numato_model_find(unsigned int const num_relays)
 {
-    return 0;
+    numato_model_st const * model;
+    size_t index;
+
+    for (index = 0; index < ARRAY_SIZE(numato_models); index++)
+    {
+        if (numato_models[index].num_relays == num_relays)
+        {
+            model = &numato_models[index];
+            goto done;
+        }
+    }
+
+    model = NULL;
+
+done:
+    return model;
 }
 
-size_t numato_num_outputs(void)
+uint64_t numato_relays_bitmask(unsigned int const num_relays)
 {
-    return 8;
+    /* Shifting by the width of the type is undefined. */
+    return (num_relays >= NUMATO_MAX_RELAYS) ? UINT64_MAX : BIT(num_relays) - 1;
 }
@@ -3,6 +3,10 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+/* The most relays on any module. */
+#define NUMATO_MAX_RELAYS 64
 
 typedef struct relay_states_st relay_states_st;
 
@@ -10,13 +14,24 @@ void relay_states_init(relay_states_st * const relay_states);
 relay_states_st * relay_states_create(void);
 void relay_states_free(relay_states_st * const relay_states);
 
-void relay_states_set_state(relay_states_st * const relay_states, unsigned int relay_index, bool const state);
+/* Returns false if relay_index is out of range. */
+bool relay_states_set_state(relay_states_st * const relay_states, unsigned int relay_index, bool const state);
+void relay_states_set_states(relay_states_st * const relay_states, uint64_t const mask, uint64_t const states);
 relay_states_st * relay_states_combine(relay_states_st const * const previous_relay_states,
                                        relay_states_st const * const new_relay_states);
-unsigned int relay_states_get_states_bitmask(relay_states_st const * const relay_states);
+uint64_t relay_states_get_states_bitmask(relay_states_st const * const relay_states);
+
+/* The Numato relay modules that are supported. */
+typedef struct numato_model_st
+{
+    unsigned int num_relays;
+    unsigned int writeall_digits; /* The number of hex digits in the writeall and readall values. */
+} numato_model_st;
 
-size_t numato_num_inputs(void);
+/* Returns NULL if there is no model with that many relays. */
+numato_model_st const * numato_model_find(unsigned int const num_relays);
 
-size_t numato_num_outputs(void);
+/* The bitmask with a bit set for each of the relays. */
+uint64_t numato_relays_bitmask(unsigned int const num_relays);
 
 #endif /* __RELAY_STATES_H__ */
@@ -1,6 +1,8 @@
 #include "socket.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -11,32 +13,60 @@
 #include <netinet/in.h>
 #include <netdb.h> 
 
-int connect_to_socket(char const * const socket_name, uint16_t const port)
+struct addrinfo * resolve_address(char const * const name, uint16_t const port)
 {
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    struct hostent * server;
+    struct addrinfo hints;
+    struct addrinfo * addresses;
+    char port_string[sizeof "65535"];
+    int error;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    snprintf(port_string, sizeof port_string, "%u", port);
 
-    server = gethostbyname(socket_name);
-    if (server == NULL)
+    error = getaddrinfo(name, port_string, &hints, &addresses);
+    if (error != 0)
     {
-        sockfd = -1;
+        addresses = NULL;
         goto done;
     }
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+done:
+    return addresses;
+}
+
+int connect_to_address(struct addrinfo const * const address, bool * const in_progress)
+{
+    int sockfd;
+
+    sockfd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
     if (sockfd < 0)
     {
         goto done;
     }
 
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    serv_addr.sin_port = htons(port);
+    /* Don't wait for the connection to complete. The caller is 
+     * told when the connection is still in progress, and can wait 
+     * for the socket to become writable. 
+     */
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        close(sockfd);
+        sockfd = -1;
+        goto done;
+    }
 
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    *in_progress = false;
+    if (connect(sockfd, address->ai_addr, address->ai_addrlen) < 0)
     {
+        if (errno == EINPROGRESS)
+        {
+            *in_progress = true;
+            goto done;
+        }
         close(sockfd);
         sockfd = -1;
         goto done;
@@ -45,3 +75,16 @@ int connect_to_socket(char const * const socket_name, uint16_t const port)
 done:
     return sockfd;
 }
+
+int socket_connect_result(int const sockfd)
+{
+    int error;
+    socklen_t error_len = sizeof error;
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+    {
+        error = errno;
+    }
+
+    return error;
+}
@@ -1,8 +1,16 @@
 #ifndef __SOCKET_H__
 #define __SOCKET_H__
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <netdb.h>
 
-int connect_to_socket(char const * const socket_name, uint16_t const port);
+/* Returns the addresses (IPv4 and/or IPv6) to try when connecting 
+ * to name, or NULL if it can't be resolved. Free them with 
+ * freeaddrinfo(). 
+ */
+struct addrinfo * resolve_address(char const * const name, uint16_t const port);
+int connect_to_address(struct addrinfo const * const address, bool * const in_progress);
+int socket_connect_result(int const sockfd);
 
 #endif /* __SOCKET_H__ */
@@ -70,9 +70,9 @@ int listen_on_unix_socket(char const * const socket_name, bool const use_abstrac
     }
     len += sizeof server.sun_family;
 
-    if (use_abstract_namespace)
+    if (!use_abstract_namespace)
     {
-        unlink(socket_name);    /* remove any previous instances of the socket (non-abstract namespace only?) */
+        unlink(socket_name);    /* remove any previous instance of the socket left by an earlier run */
     }
 
     if (bind(sock, (struct sockaddr *)&server, len))
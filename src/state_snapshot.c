@@ -0,0 +1,167 @@
+#include "state_snapshot.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* A reader only has to retry if it catches the daemon in the middle 
+ * of an update, which takes no time at all, so it will rarely need 
+ * more than one retry. 
+ */
+#define STATE_SNAPSHOT_READ_ATTEMPTS 100
+
+struct state_snapshot_st
+{
+    char * filename;
+    void * mapping;
+    size_t mapping_size;
+};
+
+state_snapshot_st * state_snapshot_create(char const * const filename, size_t const num_modules)
+{
+    bool created_snapshot;
+    state_snapshot_st * const state_snapshot = calloc(1, sizeof *state_snapshot);
+    state_snapshot_header_st * header;
+    int fd = -1;
+
+    if (state_snapshot == NULL)
+    {
+        created_snapshot = false;
+        goto done;
+    }
+    state_snapshot->mapping = MAP_FAILED;
+
+    state_snapshot->filename = strdup(filename);
+    if (state_snapshot->filename == NULL)
+    {
+        created_snapshot = false;
+        goto done;
+    }
+
+    state_snapshot->mapping_size = 
+        sizeof(state_snapshot_header_st) + num_modules * sizeof(state_snapshot_module_st);
+
+    /* Readers that opened an old file carry on reading that, rather 
+     * than seeing this one change size under them. 
+     */
+    unlink(filename);
+    fd = open(filename, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        created_snapshot = false;
+        goto done;
+    }
+
+    if (ftruncate(fd, state_snapshot->mapping_size) < 0)
+    {
+        created_snapshot = false;
+        goto done;
+    }
+
+    state_snapshot->mapping = 
+        mmap(NULL, state_snapshot->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state_snapshot->mapping == MAP_FAILED)
+    {
+        created_snapshot = false;
+        goto done;
+    }
+
+    /* The file starts out zeroed, so only the header needs filling 
+     * in. 
+     */
+    header = state_snapshot->mapping;
+    header->version = STATE_SNAPSHOT_VERSION;
+    header->num_modules = num_modules;
+    header->module_size = sizeof(state_snapshot_module_st);
+    __atomic_store_n(&header->magic, STATE_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+
+    created_snapshot = true;
+
+done:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!created_snapshot)
+    {
+        state_snapshot_free(state_snapshot);
+    }
+
+    return created_snapshot ? state_snapshot : NULL;
+}
+
+void state_snapshot_free(state_snapshot_st * const state_snapshot)
+{
+    if (state_snapshot == NULL)
+    {
+        goto done;
+    }
+
+    if (state_snapshot->mapping != MAP_FAILED)
+    {
+        munmap(state_snapshot->mapping, state_snapshot->mapping_size);
+        unlink(state_snapshot->filename);
+    }
+    free(state_snapshot->filename);
+    free(state_snapshot);
+
+done:
+    return;
+}
+
+state_snapshot_module_st * state_snapshot_module(state_snapshot_st * const state_snapshot, 
+                                                 size_t const module_index)
+{
+    state_snapshot_header_st * const header = state_snapshot->mapping;
+    state_snapshot_module_st * const modules = (state_snapshot_module_st *)(header + 1);
+
+    return (module_index < header->num_modules) ? &modules[module_index] : NULL;
+}
+
+void state_snapshot_begin_update(state_snapshot_module_st * const module)
+{
+    __atomic_store_n(&module->sequence, module->sequence + 1, __ATOMIC_RELAXED);
+    /* Readers must see the odd sequence before any of the changes. */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void state_snapshot_end_update(state_snapshot_module_st * const module)
+{
+    __atomic_store_n(&module->sequence, module->sequence + 1, __ATOMIC_RELEASE);
+}
+
+bool state_snapshot_read_module(state_snapshot_module_st const * const module,
+                                state_snapshot_module_st * const copy)
+{
+    bool read_module;
+    unsigned int attempt;
+
+    for (attempt = 0; attempt < STATE_SNAPSHOT_READ_ATTEMPTS; attempt++)
+    {
+        uint32_t const sequence = __atomic_load_n(&module->sequence, __ATOMIC_ACQUIRE);
+
+        if ((sequence & 1) != 0)
+        {
+            continue;
+        }
+
+        memcpy(copy, module, sizeof *copy);
+        /* The copy must be complete before the sequence is checked 
+         * again. 
+         */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&module->sequence, __ATOMIC_RELAXED) == sequence)
+        {
+            read_module = true;
+            goto done;
+        }
+    }
+
+    read_module = false;
+
+done:
+    return read_module;
+}
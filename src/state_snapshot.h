@@ -0,0 +1,82 @@
+#ifndef __STATE_SNAPSHOT_H__
+#define __STATE_SNAPSHOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Publishes the state of each module in a file that other processes 
+ * can map and read without talking to the daemon. The file holds a 
+ * state_snapshot_header_st followed by num_modules entries of 
+ * module_size bytes each. 
+ *
+ * Each entry is protected by a sequence lock. The daemon makes the 
+ * sequence odd while it updates the entry, and even again when it 
+ * is done, so an entry that was read while the sequence was odd, or 
+ * that changed while it was being read, must be read again. A reader 
+ * can also tell from the sequence whether anything has changed since 
+ * it last looked. state_snapshot_read_module() does all of this, and 
+ * this file can be built into readers for it. 
+ */
+
+#define STATE_SNAPSHOT_MAGIC 0x4E4D5353 /* "SSMN" */
+#define STATE_SNAPSHOT_VERSION 1
+
+#define STATE_SNAPSHOT_NAME_LENGTH 32
+
+/* Flags in state_snapshot_module_st. */
+#define STATE_SNAPSHOT_RELAYS_KNOWN (1 << 0) /* The module has confirmed its relay states. */
+#define STATE_SNAPSHOT_GPIO_INPUTS_KNOWN (1 << 1)
+#define STATE_SNAPSHOT_SESSION_UP (1 << 2) /* The daemon is logged in to the module. */
+
+typedef struct state_snapshot_header_st
+{
+    uint32_t magic; /* Set last, once the entries are ready to read. */
+    uint32_t version;
+    uint32_t num_modules;
+    uint32_t module_size;
+} state_snapshot_header_st;
+
+typedef struct state_snapshot_module_st
+{
+    uint32_t sequence;
+    uint32_t flags;
+    char name[STATE_SNAPSHOT_NAME_LENGTH]; /* The module's address if it hasn't got a name. */
+    uint32_t num_relays;
+    uint32_t reserved;
+    uint64_t relay_states; /* The daemon's copy of the relay states. */
+    uint64_t gpio_inputs;
+    uint64_t last_written_msecs; /* Realtime. 0 if the module hasn't been written to. */
+    uint64_t last_confirmed_msecs; /* Realtime. When the module last confirmed the relay states. */
+    uint32_t reconciliations;
+    uint32_t drifts;
+    uint32_t verify_failures;
+    uint32_t sessions_ended; /* Whether closed when idle or lost. */
+} state_snapshot_module_st;
+
+typedef struct state_snapshot_st state_snapshot_st;
+
+/* The file is replaced if it already exists, and removed again by 
+ * state_snapshot_free(). 
+ */
+state_snapshot_st * state_snapshot_create(char const * const filename, size_t const num_modules);
+void state_snapshot_free(state_snapshot_st * const state_snapshot);
+
+/* Returns the entry for the module at module_index, which is 
+ * updated with state_snapshot_begin_update() and 
+ * state_snapshot_end_update(). 
+ */
+state_snapshot_module_st * state_snapshot_module(state_snapshot_st * const state_snapshot, 
+                                                 size_t const module_index);
+
+void state_snapshot_begin_update(state_snapshot_module_st * const module);
+void state_snapshot_end_update(state_snapshot_module_st * const module);
+
+/* For readers. Copies a consistent snapshot of a module's entry, 
+ * and returns false if the daemon was updating it every time it was 
+ * tried. 
+ */
+bool state_snapshot_read_module(state_snapshot_module_st const * const module,
+                                state_snapshot_module_st * const copy);
+
+#endif /* __STATE_SNAPSHOT_H__ */
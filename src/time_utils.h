@@ -0,0 +1,11 @@
+#ifndef __TIME_UTILS_H__
+#define __TIME_UTILS_H__
+
+#include <stdint.h>
+
+uint64_t monotonic_time_msecs(void);
+
+/* The time of day, for times that are seen outside the daemon. */
+uint64_t realtime_msecs(void);
+
+#endif /* __TIME_UTILS_H__ */
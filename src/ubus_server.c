@@ -1,18 +1,29 @@
 #include "ubus_server.h"
 #include "ubus_private.h"
 #include "debug.h"
+#include "time_utils.h"
 #include "relay_states.h"
 
 #include <libubox/blobmsg.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-static char const gpio_object_name[] = "numato.gpio";
+static char const gpio_object_name_prefix[] = "numato";
+static char const gpio_object_name_suffix[] = "gpio";
 static char const gpio_object_type_name[] = "gpio";
 static char const gpio_get_method_name[] = "get";
 static char const gpio_set_method_name[] = "set";
 static char const gpio_count_name[] = "count";
+static char const gpio_set_mask_method_name[] = "set_mask";
+static char const gpio_get_all_method_name[] = "get_all";
+static char const gpio_status_method_name[] = "status";
+static char const gpio_all_off_method_name[] = "all_off";
+static char const gpio_adc_method_name[] = "adc";
+static char const gpio_relays_event_suffix[] = "relays";
+static char const gpio_inputs_event_suffix[] = "inputs";
+static char const gpio_adc_event_suffix[] = "adc";
 static char const gpio_io_type_str[] = "io type";
 static char const gpio_io_type_bi[] = "bi";
 static char const gpio_io_type_bo[] = "bo"; 
@@ -20,11 +31,41 @@ static char const gpio_io_type_bo[] = "bo";
 static char const pin_str[] = "pin";
 static char const state_str[] = "state";
 static char const result_str[] = "result";
+static char const mask_str[] = "mask";
+static char const values_str[] = "values";
+static char const states_str[] = "states";
+static char const pins_str[] = "pins";
+static char const reconciliations_str[] = "reconciliations";
+static char const drifts_str[] = "drifts";
+static char const verify_failures_str[] = "verify_failures";
+static char const channel_str[] = "channel";
+static char const channels_str[] = "channels";
+static char const window_str[] = "window";
+static char const samples_str[] = "samples";
+static char const min_str[] = "min";
+static char const max_str[] = "max";
+static char const mean_str[] = "mean";
+static char const last_str[] = "last";
+static char const age_str[] = "age";
+static char const changed_str[] = "changed";
+static char const time_str[] = "time";
+static char const value_str[] = "value";
+static char const threshold_str[] = "threshold";
+static char const above_str[] = "above";
+
+static struct ubus_context * ubus_ctx;
+
+/* One of these is published for each relay module. */
+typedef struct gpio_object_st
+{
+    struct list_head list;
+    struct ubus_object object;
+    char * name;
+    message_handler_st const * handlers;
+    void * user_info;
+} gpio_object_st;
 
-struct ubus_context * ubus_ctx;
-
-static message_handler_st const * handlers;
-static void * user_info;
+static LIST_HEAD(gpio_objects);
 
 enum
 {
@@ -39,11 +80,14 @@ static struct blobmsg_policy const gpio_count_policy[__GPIO_COUNT_MAX] = {
 enum
 {
     GPIO_GET_PIN,
+    GPIO_GET_TYPE,
     __GPIO_GET_MAX
 };
 
+/* The io type is optional, and defaults to "bo". */
 static struct blobmsg_policy const gpio_get_policy[__GPIO_GET_MAX] = {
-    [GPIO_GET_PIN] = {.name = pin_str, .type = BLOBMSG_TYPE_INT32}
+    [GPIO_GET_PIN] = {.name = pin_str, .type = BLOBMSG_TYPE_INT32},
+    [GPIO_GET_TYPE] = { .name = gpio_io_type_str, .type = BLOBMSG_TYPE_STRING }
 };
 
 enum
@@ -58,6 +102,191 @@ static struct blobmsg_policy const gpio_set_policy[__GPIO_SET_MAX] = {
     [GPIO_SET_STATE] = { .name = state_str, .type = BLOBMSG_TYPE_BOOL }
 };
 
+enum
+{
+    GPIO_SET_MASK_MASK,
+    GPIO_SET_MASK_VALUES,
+    __GPIO_SET_MASK_MAX
+};
+
+/* The mask and values may be int32 or int64, as modules with more 
+ * than 32 relays need the wider type. 
+ */
+static struct blobmsg_policy const gpio_set_mask_policy[__GPIO_SET_MASK_MAX] = {
+    [GPIO_SET_MASK_MASK] = { .name = mask_str, .type = BLOBMSG_TYPE_UNSPEC },
+    [GPIO_SET_MASK_VALUES] = { .name = values_str, .type = BLOBMSG_TYPE_UNSPEC }
+};
+
+enum
+{
+    GPIO_ADC_CHANNEL,
+    GPIO_ADC_WINDOW,
+    __GPIO_ADC_MAX
+};
+
+/* Both are optional. Without a channel, all of the sampled channels 
+ * are reported. The window is in milliseconds, and defaults to all 
+ * of the samples that have been kept. 
+ */
+static struct blobmsg_policy const gpio_adc_policy[__GPIO_ADC_MAX] = {
+    [GPIO_ADC_CHANNEL] = { .name = channel_str, .type = BLOBMSG_TYPE_INT32 },
+    [GPIO_ADC_WINDOW] = { .name = window_str, .type = BLOBMSG_TYPE_INT32 }
+};
+
+static size_t
+gpio_num_relays(gpio_object_st const * const gpio_object)
+{
+    return (gpio_object->handlers->get_relay_count_handler != NULL)
+           ? gpio_object->handlers->get_relay_count_handler(gpio_object->user_info)
+           : 0;
+}
+
+static bool
+gpio_get_bitmask(struct blob_attr * const attr, uint64_t * const bitmask)
+{
+    bool got_bitmask;
+
+    switch (blobmsg_type(attr))
+    {
+        case BLOBMSG_TYPE_INT32:
+            *bitmask = blobmsg_get_u32(attr);
+            got_bitmask = true;
+            break;
+        case BLOBMSG_TYPE_INT64:
+            *bitmask = blobmsg_get_u64(attr);
+            got_bitmask = true;
+            break;
+        default:
+            got_bitmask = false;
+            break;
+    }
+
+    return got_bitmask;
+}
+
+/* Relay states are sent as int32 unless the module has too many 
+ * relays to fit, so that clients of the smaller modules aren't 
+ * affected. 
+ */
+static void
+gpio_add_relay_bitmask(
+    struct blob_buf * const b,
+    char const * const name,
+    uint64_t const bitmask,
+    size_t const num_relays)
+{
+    if (num_relays > 32)
+    {
+        blobmsg_add_u64(b, name, bitmask);
+    }
+    else
+    {
+        blobmsg_add_u32(b, name, bitmask);
+    }
+}
+
+/* Replies to set requests are deferred until the module has 
+ * accepted (or failed to accept) the new relay states. 
+ */
+typedef struct deferred_set_request_st
+{
+    struct ubus_context * ctx;
+    struct ubus_request_data req;
+} deferred_set_request_st;
+
+static void
+gpio_set_done(void * const done_context, bool const success)
+{
+    deferred_set_request_st * const deferred = done_context;
+    struct blob_buf b;
+
+    local_blob_buf_init(&b, 0);
+
+    blobmsg_add_u8(&b, result_str, success);
+
+    ubus_send_reply(deferred->ctx, &deferred->req, b.head);
+    ubus_complete_deferred_request(deferred->ctx, &deferred->req, UBUS_STATUS_OK);
+
+    blob_buf_free(&b);
+    free(deferred);
+}
+
+static int
+gpio_submit_states(
+    gpio_object_st const * const gpio_object,
+    struct ubus_context * const ctx,
+    struct ubus_request_data * const req,
+    relay_states_st * const relay_states)
+{
+    int result;
+
+    if (gpio_object->handlers->set_state_handler == NULL)
+    {
+        result = UBUS_STATUS_NOT_SUPPORTED;
+        goto done;
+    }
+
+    deferred_set_request_st * const deferred = calloc(1, sizeof *deferred);
+
+    if (deferred == NULL)
+    {
+        result = UBUS_STATUS_UNKNOWN_ERROR;
+        goto done;
+    }
+
+    deferred->ctx = ctx;
+    ubus_defer_request(ctx, req, &deferred->req);
+
+    gpio_object->handlers->set_state_handler(gpio_object->user_info, relay_states, gpio_set_done, deferred);
+
+    result = 0;
+
+done:
+    return result;
+}
+
+static int
+gpio_set_output(
+    gpio_object_st const * const gpio_object,
+    struct ubus_context * const ctx,
+    struct ubus_request_data * const req,
+    uint32_t const output,
+    bool const state)
+{
+    int result;
+
+    if (gpio_object->handlers->set_gpio_output_handler == NULL
+        || gpio_object->handlers->get_gpio_count_handler == NULL)
+    {
+        result = UBUS_STATUS_NOT_SUPPORTED;
+        goto done;
+    }
+
+    if (output >= gpio_object->handlers->get_gpio_count_handler(gpio_object->user_info, GPIO_DIRECTION_OUTPUT))
+    {
+        result = UBUS_STATUS_INVALID_ARGUMENT;
+        goto done;
+    }
+
+    deferred_set_request_st * const deferred = calloc(1, sizeof *deferred);
+
+    if (deferred == NULL)
+    {
+        result = UBUS_STATUS_UNKNOWN_ERROR;
+        goto done;
+    }
+
+    deferred->ctx = ctx;
+    ubus_defer_request(ctx, req, &deferred->req);
+
+    gpio_object->handlers->set_gpio_output_handler(gpio_object->user_info, output, state, gpio_set_done, deferred);
+
+    result = 0;
+
+done:
+    return result;
+}
+
 static int
 gpio_set_handler(
     struct ubus_context * ctx,
@@ -66,9 +295,9 @@ gpio_set_handler(
     const char * method,
     struct blob_attr * msg)
 {
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
     int result;
     struct blob_attr * tb[__GPIO_SET_MAX];
-    struct blob_buf b; 
 
     blobmsg_parse(gpio_set_policy,
                   ARRAY_SIZE(gpio_set_policy),
@@ -85,29 +314,208 @@ gpio_set_handler(
     uint32_t const pin = blobmsg_get_u32(tb[GPIO_SET_PIN]);
     bool const state = blobmsg_get_bool(tb[GPIO_SET_STATE]);
 
+    size_t const num_relays = gpio_num_relays(gpio_object);
+
+    if (pin >= num_relays)
+    {
+        /* The GPIO outputs follow on from the relays. */
+        result = gpio_set_output(gpio_object, ctx, req, pin - num_relays, state);
+        goto done;
+    }
+
     relay_states_st * const relay_states = relay_states_create();
 
-    if (relay_states != NULL)
+    if (relay_states == NULL)
     {
-        relay_states_set_state(relay_states, pin, state);
+        result = UBUS_STATUS_UNKNOWN_ERROR;
+        goto done;
+    }
 
-        if (handlers->set_state_handler != NULL)
-        {
-            handlers->set_state_handler(user_info, relay_states);
-        }
+    relay_states_set_state(relay_states, pin, state);
+
+    result = gpio_submit_states(gpio_object, ctx, req, relay_states);
+
+    relay_states_free(relay_states);
+
+done:
+    return result;
+}
+
+static int
+gpio_set_mask_handler(
+    struct ubus_context * ctx,
+    struct ubus_object * obj,
+    struct ubus_request_data * req,
+    const char * method,
+    struct blob_attr * msg)
+{
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
+    int result;
+    struct blob_attr * tb[__GPIO_SET_MASK_MAX];
 
-        relay_states_free(relay_states);
+    blobmsg_parse(gpio_set_mask_policy,
+                  ARRAY_SIZE(gpio_set_mask_policy),
+                  tb,
+                  blob_data(msg),
+                  blob_len(msg));
+
+    if (tb[GPIO_SET_MASK_MASK] == NULL || tb[GPIO_SET_MASK_VALUES] == NULL)
+    {
+        result = UBUS_STATUS_INVALID_ARGUMENT;
+        goto done;
     }
 
+    uint64_t mask;
+    uint64_t values;
+
+    if (!gpio_get_bitmask(tb[GPIO_SET_MASK_MASK], &mask)
+        || !gpio_get_bitmask(tb[GPIO_SET_MASK_VALUES], &values)
+        || (mask & ~numato_relays_bitmask(gpio_num_relays(gpio_object))) != 0)
+    {
+        result = UBUS_STATUS_INVALID_ARGUMENT;
+        goto done;
+    }
+
+    relay_states_st * const relay_states = relay_states_create();
+
+    if (relay_states == NULL)
+    {
+        result = UBUS_STATUS_UNKNOWN_ERROR;
+        goto done;
+    }
+
+    relay_states_set_states(relay_states, mask, values);
+
+    result = gpio_submit_states(gpio_object, ctx, req, relay_states);
+
+    relay_states_free(relay_states);
+
+done:
+    return result;
+}
 
-    /* XXX - TODO: Update the state of the relay here. */
-    bool const success = true;
+/* Replies to get requests are deferred, as the states may need to 
+ * be read from the module. 
+ */
+typedef struct deferred_get_request_st
+{
+    struct ubus_context * ctx;
+    struct ubus_request_data req;
+    bool get_all;
+    uint32_t pin;
+    size_t num_relays;
+} deferred_get_request_st;
+
+static void
+gpio_get_done(void * const done_context, bool const success, uint64_t const states)
+{
+    deferred_get_request_st * const deferred = done_context;
+    struct blob_buf b;
 
     local_blob_buf_init(&b, 0);
 
     blobmsg_add_u8(&b, result_str, success);
+    if (success && deferred->get_all)
+    {
+        size_t pin;
 
-    ubus_send_reply(ctx, req, b.head);
+        gpio_add_relay_bitmask(&b, states_str, states, deferred->num_relays);
+
+        void * const pins = blobmsg_open_array(&b, pins_str);
+
+        for (pin = 0; pin < deferred->num_relays; pin++)
+        {
+            blobmsg_add_u8(&b, NULL, (states & ((uint64_t)1 << pin)) != 0);
+        }
+        blobmsg_close_array(&b, pins);
+    }
+    else if (success)
+    {
+        blobmsg_add_u8(&b, state_str, (states & ((uint64_t)1 << deferred->pin)) != 0);
+    }
+
+    ubus_send_reply(deferred->ctx, &deferred->req, b.head);
+    ubus_complete_deferred_request(deferred->ctx, &deferred->req, UBUS_STATUS_OK);
+
+    blob_buf_free(&b);
+    free(deferred);
+}
+
+static int
+gpio_get_states(
+    gpio_object_st const * const gpio_object,
+    struct ubus_context * const ctx,
+    struct ubus_request_data * const req,
+    bool const get_all,
+    uint32_t const pin)
+{
+    int result;
+
+    if (gpio_object->handlers->get_states_handler == NULL)
+    {
+        result = UBUS_STATUS_NOT_SUPPORTED;
+        goto done;
+    }
+
+    deferred_get_request_st * const deferred = calloc(1, sizeof *deferred);
+
+    if (deferred == NULL)
+    {
+        result = UBUS_STATUS_UNKNOWN_ERROR;
+        goto done;
+    }
+
+    deferred->ctx = ctx;
+    deferred->get_all = get_all;
+    deferred->pin = pin;
+    deferred->num_relays = gpio_num_relays(gpio_object);
+    ubus_defer_request(ctx, req, &deferred->req);
+
+    gpio_object->handlers->get_states_handler(gpio_object->user_info, gpio_get_done, deferred);
+
+    result = 0;
+
+done:
+    return result;
+}
+
+static int
+gpio_get_gpio_state(
+    gpio_object_st const * const gpio_object,
+    struct ubus_context * const ctx,
+    struct ubus_request_data * const req,
+    gpio_direction_t const direction,
+    uint32_t const pin)
+{
+    int result;
+
+    if (gpio_object->handlers->get_gpio_states_handler == NULL
+        || gpio_object->handlers->get_gpio_count_handler == NULL)
+    {
+        result = UBUS_STATUS_NOT_SUPPORTED;
+        goto done;
+    }
+
+    if (pin >= gpio_object->handlers->get_gpio_count_handler(gpio_object->user_info, direction))
+    {
+        result = UBUS_STATUS_INVALID_ARGUMENT;
+        goto done;
+    }
+
+    deferred_get_request_st * const deferred = calloc(1, sizeof *deferred);
+
+    if (deferred == NULL)
+    {
+        result = UBUS_STATUS_UNKNOWN_ERROR;
+        goto done;
+    }
+
+    deferred->ctx = ctx;
+    deferred->get_all = false;
+    deferred->pin = pin;
+    ubus_defer_request(ctx, req, &deferred->req);
+
+    gpio_object->handlers->get_gpio_states_handler(gpio_object->user_info, direction, gpio_get_done, deferred);
 
     result = 0;
 
@@ -123,9 +531,9 @@ gpio_get_handler(
     const char * method,
     struct blob_attr * msg)
 {
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
     int result;
     struct blob_attr * tb[__GPIO_GET_MAX];
-    struct blob_buf b; 
 
     blobmsg_parse(gpio_get_policy,
                   ARRAY_SIZE(gpio_get_policy),
@@ -140,24 +548,198 @@ gpio_get_handler(
     }
 
     uint32_t const pin = blobmsg_get_u32(tb[GPIO_GET_PIN]);
-    bool state;
+    char const * const io_type = 
+        (tb[GPIO_GET_TYPE] != NULL) ? blobmsg_get_string(tb[GPIO_GET_TYPE]) : gpio_io_type_bo;
+
+    if (strcmp(io_type, gpio_io_type_bi) == 0)
+    {
+        result = gpio_get_gpio_state(gpio_object, ctx, req, GPIO_DIRECTION_INPUT, pin);
+    }
+    else if (strcmp(io_type, gpio_io_type_bo) != 0)
+    {
+        result = UBUS_STATUS_INVALID_ARGUMENT;
+    }
+    else if (pin >= gpio_num_relays(gpio_object))
+    {
+        /* The GPIO outputs follow on from the relays. */
+        result = gpio_get_gpio_state(gpio_object, ctx, req, GPIO_DIRECTION_OUTPUT, pin - gpio_num_relays(gpio_object));
+    }
+    else
+    {
+        result = gpio_get_states(gpio_object, ctx, req, false, pin);
+    }
+
+done:
+    return result;
+}
+
+static int
+gpio_get_all_handler(
+    struct ubus_context * ctx,
+    struct ubus_object * obj,
+    struct ubus_request_data * req,
+    const char * method,
+    struct blob_attr * msg)
+{
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
+    return gpio_get_states(gpio_object, ctx, req, true, 0);
+}
+
+static int
+gpio_all_off_handler(
+    struct ubus_context * ctx,
+    struct ubus_object * obj,
+    struct ubus_request_data * req,
+    const char * method,
+    struct blob_attr * msg)
+{
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
+    int result;
 
-    (void)pin;
+    if (gpio_object->handlers->all_off_handler == NULL)
+    {
+        result = UBUS_STATUS_NOT_SUPPORTED;
+        goto done;
+    }
+
+    deferred_set_request_st * const deferred = calloc(1, sizeof *deferred);
+
+    if (deferred == NULL)
+    {
+        result = UBUS_STATUS_UNKNOWN_ERROR;
+        goto done;
+    }
+
+    deferred->ctx = ctx;
+    ubus_defer_request(ctx, req, &deferred->req);
+
+    gpio_object->handlers->all_off_handler(gpio_object->user_info, gpio_set_done, deferred);
+
+    result = 0;
 
-    /* XXX - TODO: get teh input state (are there any?) here. */
-    state = false;
-    bool const success = true;
+done:
+    return result;
+}
+
+static int
+gpio_status_handler(
+    struct ubus_context * ctx,
+    struct ubus_object * obj,
+    struct ubus_request_data * req,
+    const char * method,
+    struct blob_attr * msg)
+{
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
+    int result;
+    struct blob_buf b;
+    relay_status_st status;
+
+    if (gpio_object->handlers->get_status_handler == NULL)
+    {
+        result = UBUS_STATUS_NOT_SUPPORTED;
+        goto done;
+    }
+
+    gpio_object->handlers->get_status_handler(gpio_object->user_info, &status);
 
     local_blob_buf_init(&b, 0);
 
-    blobmsg_add_u8(&b, result_str, success);
-    if (success)
+    blobmsg_add_u32(&b, reconciliations_str, status.reconciliations);
+    blobmsg_add_u32(&b, drifts_str, status.drifts);
+    blobmsg_add_u32(&b, verify_failures_str, status.verify_failures);
+
+    ubus_send_reply(ctx, req, b.head);
+
+    blob_buf_free(&b);
+
+    result = 0;
+
+done:
+    return result;
+}
+
+static void
+gpio_add_adc_stats(
+    struct blob_buf * const b,
+    unsigned int const channel,
+    adc_stats_st const * const stats)
+{
+    blobmsg_add_u32(b, channel_str, channel);
+    blobmsg_add_u32(b, samples_str, stats->samples);
+    if (stats->samples > 0)
+    {
+        blobmsg_add_u32(b, min_str, stats->minimum);
+        blobmsg_add_u32(b, max_str, stats->maximum);
+        blobmsg_add_double(b, mean_str, stats->mean);
+        blobmsg_add_u32(b, last_str, stats->last);
+        blobmsg_add_u32(b, age_str, stats->last_age_millisecs);
+    }
+}
+
+static int
+gpio_adc_handler(
+    struct ubus_context * ctx,
+    struct ubus_object * obj,
+    struct ubus_request_data * req,
+    const char * method,
+    struct blob_attr * msg)
+{
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
+    int result;
+    struct blob_attr * tb[__GPIO_ADC_MAX];
+    struct blob_buf b;
+    adc_stats_st stats;
+
+    if (gpio_object->handlers->get_adc_stats_handler == NULL)
     {
-        blobmsg_add_u8(&b, state_str, state);
+        result = UBUS_STATUS_NOT_SUPPORTED;
+        goto done;
+    }
+
+    blobmsg_parse(gpio_adc_policy,
+                  ARRAY_SIZE(gpio_adc_policy),
+                  tb,
+                  blob_data(msg),
+                  blob_len(msg));
+
+    uint32_t const window = (tb[GPIO_ADC_WINDOW] != NULL) ? blobmsg_get_u32(tb[GPIO_ADC_WINDOW]) : 0;
+
+    local_blob_buf_init(&b, 0);
+
+    if (tb[GPIO_ADC_CHANNEL] != NULL)
+    {
+        uint32_t const channel = blobmsg_get_u32(tb[GPIO_ADC_CHANNEL]);
+
+        if (!gpio_object->handlers->get_adc_stats_handler(gpio_object->user_info, channel, window, &stats))
+        {
+            blob_buf_free(&b);
+            result = UBUS_STATUS_INVALID_ARGUMENT;
+            goto done;
+        }
+        gpio_add_adc_stats(&b, channel, &stats);
+    }
+    else
+    {
+        void * const channels = blobmsg_open_array(&b, channels_str);
+        unsigned int channel;
+
+        for (channel = 0; channel < ADC_MAX_CHANNELS; channel++)
+        {
+            if (gpio_object->handlers->get_adc_stats_handler(gpio_object->user_info, channel, window, &stats))
+            {
+                void * const table = blobmsg_open_table(&b, NULL);
+
+                gpio_add_adc_stats(&b, channel, &stats);
+                blobmsg_close_table(&b, table);
+            }
+        }
+        blobmsg_close_array(&b, channels);
     }
 
     ubus_send_reply(ctx, req, b.head);
 
+    blob_buf_free(&b);
+
     result = 0;
 
 done:
@@ -172,6 +754,7 @@ gpio_count_handler(
     const char * method,
     struct blob_attr * msg)
 {
+    gpio_object_st const * const gpio_object = container_of(obj, gpio_object_st, object);
     int result;
     struct blob_attr * tb[__GPIO_COUNT_MAX];
     struct blob_buf b;
@@ -189,15 +772,22 @@ gpio_count_handler(
     }
 
     char const * const io_type = blobmsg_get_string(tb[GPIO_COUNT_TYPE]);
+    get_gpio_count_handler_fn const get_gpio_count = gpio_object->handlers->get_gpio_count_handler;
     int count;
 
     if (strcmp(io_type, gpio_io_type_bi) == 0)
     {
-        count = numato_num_inputs();
+        count = (get_gpio_count != NULL) 
+                ? get_gpio_count(gpio_object->user_info, GPIO_DIRECTION_INPUT) 
+                : 0;
     }
     else if (strcmp(io_type, gpio_io_type_bo) == 0)
     {
-        count = numato_num_outputs();
+        count = gpio_num_relays(gpio_object);
+        if (get_gpio_count != NULL)
+        {
+            count += get_gpio_count(gpio_object->user_info, GPIO_DIRECTION_OUTPUT);
+        }
     }
     else
     {
@@ -210,6 +800,8 @@ gpio_count_handler(
 
     ubus_send_reply(ctx, req, b.head);
 
+    blob_buf_free(&b);
+
     result = 0;
 
 done:
@@ -236,37 +828,168 @@ gpio_add_object(
 static struct ubus_method gpio_object_methods[] = {
     UBUS_METHOD(gpio_get_method_name, gpio_get_handler, gpio_get_policy),
     UBUS_METHOD(gpio_set_method_name, gpio_set_handler, gpio_set_policy),
-    UBUS_METHOD(gpio_count_name, gpio_count_handler, gpio_count_policy)
+    UBUS_METHOD(gpio_count_name, gpio_count_handler, gpio_count_policy),
+    UBUS_METHOD(gpio_set_mask_method_name, gpio_set_mask_handler, gpio_set_mask_policy),
+    UBUS_METHOD_NOARG(gpio_get_all_method_name, gpio_get_all_handler),
+    UBUS_METHOD_NOARG(gpio_status_method_name, gpio_status_handler),
+    UBUS_METHOD_NOARG(gpio_all_off_method_name, gpio_all_off_handler),
+    UBUS_METHOD(gpio_adc_method_name, gpio_adc_handler, gpio_adc_policy)
 };
 
 static struct ubus_object_type gpio_object_type =
     UBUS_OBJECT_TYPE(gpio_object_type_name, gpio_object_methods);
 
-static struct ubus_object gpio_object =
+/* Changes are sent as events named after the object, so that 
+ * clients can listen for them rather than polling e.g. 
+ * numato.gpio.inputs. 
+ */
+static void
+gpio_object_state_changed(void * const changed_context, state_change_st const * const change)
 {
-    .name = gpio_object_name,
-    .type = &gpio_object_type,
-    .methods = gpio_object_methods,
-    .n_methods = ARRAY_SIZE(gpio_object_methods)
-};
+    gpio_object_st const * const gpio_object = changed_context;
+    char const * event_suffix;
+    char * event_name;
+    struct blob_buf b;
+
+    if (ubus_ctx == NULL)
+    {
+        goto done;
+    }
+
+    local_blob_buf_init(&b, 0);
+
+    switch (change->type)
+    {
+        case STATE_CHANGE_RELAYS:
+            event_suffix = gpio_relays_event_suffix;
+            gpio_add_relay_bitmask(&b, states_str, change->states, gpio_num_relays(gpio_object));
+            gpio_add_relay_bitmask(&b, changed_str, change->changed, gpio_num_relays(gpio_object));
+            break;
+        case STATE_CHANGE_GPIO_INPUTS:
+            event_suffix = gpio_inputs_event_suffix;
+            blobmsg_add_u32(&b, states_str, change->states);
+            blobmsg_add_u32(&b, changed_str, change->changed);
+            break;
+        case STATE_CHANGE_ADC_THRESHOLD:
+        default:
+            event_suffix = gpio_adc_event_suffix;
+            blobmsg_add_u32(&b, channel_str, change->channel);
+            blobmsg_add_u32(&b, value_str, change->value);
+            blobmsg_add_u32(&b, threshold_str, change->threshold);
+            blobmsg_add_u8(&b, above_str, change->above_threshold);
+            break;
+    }
+    blobmsg_add_u64(&b, time_str, realtime_msecs());
+
+    if (asprintf(&event_name, "%s.%s", gpio_object->name, event_suffix) >= 0)
+    {
+        ubus_send_event(ubus_ctx, event_name, b.head);
+        free(event_name);
+    }
+
+    blob_buf_free(&b);
+
+done:
+    return;
+}
+
+static void
+gpio_object_free(gpio_object_st * const gpio_object)
+{
+    free(gpio_object->name);
+    free(gpio_object);
+}
 
 bool
-ubus_server_initialise(
-    struct ubus_context * const ctx,
-    message_handler_st const * const handlers_in,
-    void * const user_info_in)
+ubus_server_add_module(
+    char const * const module_name,
+    message_handler_st const * const handlers,
+    void * const user_info)
+{
+    bool added_module;
+    gpio_object_st * const gpio_object = calloc(1, sizeof *gpio_object);
+    int name_result;
+
+    if (gpio_object == NULL)
+    {
+        added_module = false;
+        goto done;
+    }
+
+    /* A module without a name is published as numato.gpio. */
+    if (module_name == NULL)
+    {
+        name_result = asprintf(&gpio_object->name, "%s.%s",
+                               gpio_object_name_prefix, gpio_object_name_suffix);
+    }
+    else
+    {
+        name_result = asprintf(&gpio_object->name, "%s.%s.%s",
+                               gpio_object_name_prefix, module_name, gpio_object_name_suffix);
+    }
+    if (name_result < 0)
+    {
+        gpio_object->name = NULL;
+        gpio_object_free(gpio_object);
+        added_module = false;
+        goto done;
+    }
+
+    gpio_object->handlers = handlers;
+    gpio_object->user_info = user_info;
+    gpio_object->object.name = gpio_object->name;
+    gpio_object->object.type = &gpio_object_type;
+    gpio_object->object.methods = gpio_object_methods;
+    gpio_object->object.n_methods = ARRAY_SIZE(gpio_object_methods);
+
+    if (!gpio_add_object(ubus_ctx, &gpio_object->object))
+    {
+        gpio_object_free(gpio_object);
+        added_module = false;
+        goto done;
+    }
+
+    list_add_tail(&gpio_object->list, &gpio_objects);
+
+    if (handlers->set_state_changed_handler != NULL)
+    {
+        handlers->set_state_changed_handler(user_info, gpio_object_state_changed, gpio_object);
+    }
+
+    added_module = true;
+
+done:
+    return added_module;
+}
+
+bool
+ubus_server_initialise(struct ubus_context * const ctx)
 {
     ubus_ctx = ctx;
-    handlers = handlers_in;
-    user_info = user_info_in;
 
-    return gpio_add_object(ubus_ctx, &gpio_object);
+    return true;
 }
 
 void
 ubus_server_done(void)
 {
+    gpio_object_st * gpio_object;
+    gpio_object_st * tmp;
+
+    list_for_each_entry_safe(gpio_object, tmp, &gpio_objects, list)
+    {
+        list_del(&gpio_object->list);
+        if (gpio_object->handlers->set_state_changed_handler != NULL)
+        {
+            gpio_object->handlers->set_state_changed_handler(gpio_object->user_info, NULL, NULL);
+        }
+        if (ubus_ctx != NULL)
+        {
+            ubus_remove_object(ubus_ctx, &gpio_object->object);
+        }
+        gpio_object_free(gpio_object);
+    }
+
     ubus_ctx = NULL;
 }
 
-
@@ -7,10 +7,16 @@
 #include <stdbool.h>
 
 bool
-ubus_server_initialise(
-    struct ubus_context * const ctx,
-    message_handler_st const * const handlers_in,
-    void * const user_info_in);
+ubus_server_initialise(struct ubus_context * const ctx);
+
+/* Publishes the gpio object for a relay module. The handlers are 
+ * called with user_info. 
+ */
+bool
+ubus_server_add_module(
+    char const * const module_name,
+    message_handler_st const * const handlers,
+    void * const user_info);
 
 void
 ubus_server_done(void);